@@ -0,0 +1,489 @@
+/*
+ * bench.c
+ *
+ * Host benchmarks for the FPM protocol layer, no sensor needed:
+ * the "sensor" is an in-memory loopback replaying canned replies.
+ *
+ * Build with:
+ *     gcc -O2 -I../../src ../../src/fpm.c ../../src/fpm_image.c bench.c -o bench
+ *
+ * Usage:
+ *     bench [-j]
+ *
+ *     -j  prints the results as a JSON object instead of tables, for tracking
+ *         regressions. Each result has a name, a unit and a value, and names stay
+ *         the same across releases.
+ */
+
+#include "fpm.h"
+#include "fpm_image.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+/* typical template size, some modules use 512 bytes */
+#define TEMPLATE_SZ         768
+#define UPLOAD_ROUNDS       20000
+#define UNPACK_ROUNDS       2000
+#define CAPTURE_ROUNDS      50
+#define PARSE_ROUNDS        20000
+#define COMMAND_ROUNDS      20000
+
+/* commands queued at a time, their replies have to fit in 'rx_buf' */
+#define COMMAND_BATCH       400
+
+/* the sensors' default baud rate, for the wire time estimate */
+#define SENSOR_BAUD         57600
+
+static FPM finger;
+static uint8_t template_buffer[TEMPLATE_SZ];
+
+static int json_output;
+static int json_results;
+
+/* tables, only without -j */
+static void say(const char * fmt, ...)
+{
+    va_list args;
+
+    if (json_output)
+        return;
+
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+static void result(const char * name, const char * unit, double value)
+{
+    if (!json_output)
+        return;
+
+    printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f}",
+            json_results++ ? "," : "", name, unit, value);
+}
+
+/* counting sink, standing in for the UART driver */
+static uint32_t tx_calls;
+static uint32_t tx_bytes;
+
+static void count_write(uint8_t * bytes, uint16_t len)
+{
+    (void)bytes;
+    tx_calls++;
+    tx_bytes += len;
+}
+
+/* canned replies from the "sensor", replayed by the read functions.
+ * Big enough for an image in the smallest packets, plus an ACK */
+static uint8_t rx_buf[FPM_IMAGE_PACKED_SZ + (FPM_IMAGE_PACKED_SZ / 32 + 2) * FPM_PKT_OVERHEAD_LEN];
+static uint32_t rx_len;
+static uint32_t rx_pos;
+
+static uint16_t replay_read(uint8_t * bytes, uint16_t len)
+{
+    if (len > rx_len - rx_pos)
+        len = rx_len - rx_pos;
+
+    memcpy(bytes, &rx_buf[rx_pos], len);
+    rx_pos += len;
+    return len;
+}
+
+static uint16_t replay_avail(void)
+{
+    uint32_t avail = rx_len - rx_pos;
+    return (avail > 0xFFFF) ? 0xFFFF : (uint16_t)avail;
+}
+
+static void queue_packet(uint8_t pid, const uint8_t * payload, uint16_t len)
+{
+    uint16_t wire_len = len + 2;
+    uint16_t sum = pid + (wire_len >> 8) + (wire_len & 0xFF);
+    uint8_t * p = &rx_buf[rx_len];
+
+    p[0] = FPM_STARTCODE >> 8; p[1] = FPM_STARTCODE & 0xFF;
+    p[2] = 0xFF; p[3] = 0xFF; p[4] = 0xFF; p[5] = 0xFF;
+    p[6] = pid;
+    p[7] = wire_len >> 8; p[8] = wire_len & 0xFF;
+
+    for (uint16_t i = 0; i < len; i++) {
+        p[FPM_PKT_HEADER_LEN + i] = payload[i];
+        sum += payload[i];
+    }
+
+    p[FPM_PKT_HEADER_LEN + len] = sum >> 8;
+    p[FPM_PKT_HEADER_LEN + len + 1] = sum & 0xFF;
+    rx_len += FPM_PKT_HEADER_LEN + len + 2;
+}
+
+static void queue_ack(void)
+{
+    uint8_t ok = FPM_OK;
+    queue_packet(FPM_ACKPACKET, &ok, 1);
+}
+
+static uint32_t host_millis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* write_packet(), through fpm_write_raw() */
+static void bench_template_upload(void)
+{
+    char name[48];
+
+    say("Template upload (%d bytes) through fpm_write_raw:\r\n", TEMPLATE_SZ);
+    say("%8s %12s %12s %14s %10s\r\n", "plen", "calls/tmpl", "bytes/tmpl", "MB/s (host)", "ns/byte");
+
+    for (uint8_t plen = FPM_PLEN_32; plen <= FPM_PLEN_256; plen++) {
+        finger.sys_params.packet_len = plen;
+        tx_calls = 0;
+        tx_bytes = 0;
+
+        double start = now_sec();
+        for (int i = 0; i < UPLOAD_ROUNDS; i++)
+            fpm_write_raw(&finger, template_buffer, TEMPLATE_SZ);
+        double elapsed = now_sec() - start;
+
+        say("%8d %12u %12u %14.1f %10.2f\r\n", fpm_packet_lengths[plen],
+                tx_calls / UPLOAD_ROUNDS, tx_bytes / UPLOAD_ROUNDS,
+                (double)tx_bytes / elapsed / 1e6, elapsed * 1e9 / tx_bytes);
+
+        snprintf(name, sizeof(name), "framing.plen%d", fpm_packet_lengths[plen]);
+        result(name, "ns/byte", elapsed * 1e9 / tx_bytes);
+    }
+}
+
+/* the replies to a template download, in packets of 'chunk' bytes */
+static void queue_template(uint16_t chunk)
+{
+    for (uint32_t pos = 0; pos < TEMPLATE_SZ; pos += chunk)
+        queue_packet((pos + chunk >= TEMPLATE_SZ) ? FPM_ENDDATAPACKET : FPM_DATAPACKET,
+                     &template_buffer[pos], chunk);
+}
+
+/* get_reply() and the parser, through fpm_read_raw() */
+static void bench_template_download(void)
+{
+    static uint8_t payload[FPM_MAX_PACKET_LEN];
+    char name[48];
+
+    say("\r\nTemplate download (%d bytes) through fpm_read_raw:\r\n", TEMPLATE_SZ);
+    say("%8s %12s %14s %10s\r\n", "plen", "packets", "MB/s (host)", "ns/byte");
+
+    for (uint8_t plen = FPM_PLEN_32; plen <= FPM_PLEN_256; plen++) {
+        uint16_t chunk = fpm_packet_lengths[plen];
+        uint32_t packets = 0;
+        uint32_t wire_bytes = 0;
+        double elapsed = 0;
+
+        finger.sys_params.packet_len = plen;
+
+        for (int round = 0; round < PARSE_ROUNDS; round++) {
+            uint8_t read_complete = 0;
+
+            rx_len = rx_pos = 0;
+            queue_template(chunk);
+            wire_bytes += rx_len;
+
+            double start = now_sec();
+            while (!read_complete) {
+                uint16_t read_len = sizeof(payload);
+
+                if (!fpm_read_raw(&finger, FPM_OUTPUT_TO_BUFFER, payload, &read_complete, &read_len)) {
+                    say("Download failed\r\n");
+                    return;
+                }
+
+                packets++;
+            }
+            elapsed += now_sec() - start;
+        }
+
+        say("%8d %12u %14.1f %10.2f\r\n", chunk, packets / PARSE_ROUNDS,
+                wire_bytes / elapsed / 1e6, elapsed * 1e9 / wire_bytes);
+
+        snprintf(name, sizeof(name), "parsing.plen%d", chunk);
+        result(name, "ns/byte", elapsed * 1e9 / wire_bytes);
+    }
+}
+
+static uint32_t parsed_packets;
+
+static void count_packet(void * ctx, uint8_t pid, uint8_t * data, uint16_t len)
+{
+    (void)ctx; (void)pid; (void)data; (void)len;
+    parsed_packets++;
+}
+
+/* the parser alone: framing and checksum validation per packet, from one buffer */
+static void bench_checksum(void)
+{
+    static uint8_t payload[FPM_MAX_PACKET_LEN];
+    FPM_Parser parser;
+    char name[48];
+
+    fpm_parser_init(&parser, FPM_DEFAULT_ADDRESS, payload, sizeof(payload), count_packet, NULL);
+
+    say("\r\nPacket validation through fpm_parser_feed:\r\n");
+    say("%8s %12s\r\n", "payload", "ns/packet");
+
+    for (uint16_t len = 1; len <= FPM_MAX_PACKET_LEN; len = (len == 1) ? 32 : len * 2) {
+        rx_len = 0;
+        while (rx_len + FPM_PKT_OVERHEAD_LEN + len <= sizeof(rx_buf))
+            queue_packet(FPM_DATAPACKET, template_buffer, len);
+
+        parsed_packets = 0;
+        double start = now_sec();
+        for (int round = 0; round < 50; round++) {
+            for (uint32_t pos = 0; pos < rx_len; pos += 0xFFFF)
+                fpm_parser_feed(&parser, &rx_buf[pos], (rx_len - pos > 0xFFFF) ? 0xFFFF : rx_len - pos);
+        }
+        double elapsed = now_sec() - start;
+
+        say("%8d %12.1f\r\n", len, elapsed * 1e9 / parsed_packets);
+
+        snprintf(name, sizeof(name), "checksum.payload%d", len);
+        result(name, "ns/packet", elapsed * 1e9 / parsed_packets);
+    }
+}
+
+static int16_t run_get_free_index(void)
+{
+    int16_t id;
+    return fpm_get_free_index(&finger, 0, &id);
+}
+
+static int16_t run_get_image(void) { return fpm_get_image(&finger); }
+static int16_t run_image2tz(void) { return fpm_image2Tz(&finger, 1); }
+static int16_t run_create_model(void) { return fpm_create_model(&finger); }
+static int16_t run_store_model(void) { return fpm_store_model(&finger, 1, 1); }
+static int16_t run_load_model(void) { return fpm_load_model(&finger, 1, 1); }
+static int16_t run_delete_model(void) { return fpm_delete_model(&finger, 1, 1); }
+
+static int16_t run_search(void)
+{
+    uint16_t id, score;
+    return fpm_search_database(&finger, &id, &score, 1);
+}
+
+static int16_t run_match(void)
+{
+    uint16_t score;
+    return fpm_match_template_pair(&finger, &score);
+}
+
+static int16_t run_template_count(void)
+{
+    uint16_t count;
+    return fpm_get_template_count(&finger, &count);
+}
+
+static int16_t run_random(void)
+{
+    uint32_t number;
+    return fpm_get_random_number(&finger, &number);
+}
+
+typedef struct {
+    const char * name;
+    int16_t (*run)(void);
+    /* what follows the confirmation code in the reply */
+    uint8_t reply_len;
+} command_bench_t;
+
+static const command_bench_t commands[] = {
+    { "getimage",       run_get_image,          0 },
+    { "image2tz",       run_image2tz,           0 },
+    { "regmodel",       run_create_model,       0 },
+    { "store",          run_store_model,        0 },
+    { "load",           run_load_model,         0 },
+    { "delete",         run_delete_model,       0 },
+    { "search",         run_search,             4 },
+    { "match",          run_match,              2 },
+    { "templatecount",  run_template_count,     2 },
+    { "readindex",      run_get_free_index,     32 },
+    { "getrandom",      run_random,             4 },
+};
+
+/* whole commands: write_packet(), get_reply() and decoding */
+static void bench_commands(void)
+{
+    uint8_t reply[1 + 32];
+    char name[48];
+
+    say("\r\nCommands, replies from memory:\r\n");
+    say("%14s %14s %10s\r\n", "command", "commands/s", "ns/cmd");
+
+    /* for READTEMPLATEINDEX, a page with only the last ID free, the slowest one to scan */
+    reply[0] = FPM_OK;
+    memset(&reply[1], 0xFF, 32);
+    reply[32] = 0x7F;
+
+    for (uint8_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        const command_bench_t * cmd = &commands[i];
+        double elapsed = 0;
+
+        for (int done = 0; done < COMMAND_ROUNDS; done += COMMAND_BATCH) {
+            rx_len = rx_pos = 0;
+            for (int n = 0; n < COMMAND_BATCH; n++)
+                queue_packet(FPM_ACKPACKET, reply, 1 + cmd->reply_len);
+
+            double start = now_sec();
+            for (int n = 0; n < COMMAND_BATCH; n++) {
+                if (cmd->run() != FPM_OK) {
+                    say("%s failed\r\n", cmd->name);
+                    return;
+                }
+            }
+            elapsed += now_sec() - start;
+        }
+
+        say("%14s %14.0f %10.1f\r\n", cmd->name, COMMAND_ROUNDS / elapsed, elapsed * 1e9 / COMMAND_ROUNDS);
+
+        snprintf(name, sizeof(name), "command.%s", cmd->name);
+        result(name, "commands/s", COMMAND_ROUNDS / elapsed);
+    }
+}
+
+static uint8_t packed_image[FPM_IMAGE_PACKED_SZ];
+static uint8_t image[FPM_IMAGE_SZ];
+static uint32_t image_pos;
+static uint8_t expected_image[FPM_IMAGE_SZ];
+
+static void bench_unpack(void)
+{
+    say("\r\nPixel unpacking (%d packed bytes):\r\n", FPM_IMAGE_PACKED_SZ);
+    say("%12s %14s\r\n", "kernel", "MB/s (in)");
+
+    double start = now_sec();
+    for (int i = 0; i < UNPACK_ROUNDS; i++)
+        fpm_unpack_pixels_ref(packed_image, image, FPM_IMAGE_PACKED_SZ);
+    double ref = now_sec() - start;
+
+    start = now_sec();
+    for (int i = 0; i < UNPACK_ROUNDS; i++)
+        fpm_unpack_pixels(packed_image, image, FPM_IMAGE_PACKED_SZ);
+    double fast = now_sec() - start;
+
+    say("%12s %14.1f\r\n", "reference", (double)FPM_IMAGE_PACKED_SZ * UNPACK_ROUNDS / ref / 1e6);
+    say("%12s %14.1f\r\n", "fpm_unpack", (double)FPM_IMAGE_PACKED_SZ * UNPACK_ROUNDS / fast / 1e6);
+
+    result("unpack.reference", "MB/s", (double)FPM_IMAGE_PACKED_SZ * UNPACK_ROUNDS / ref / 1e6);
+    result("unpack.fast", "MB/s", (double)FPM_IMAGE_PACKED_SZ * UNPACK_ROUNDS / fast / 1e6);
+}
+
+static void to_image(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last)
+{
+    (void)ctx; (void)is_last;
+
+    if (len > FPM_IMAGE_SZ - image_pos)
+        len = FPM_IMAGE_SZ - image_pos;
+
+    memcpy(&image[image_pos], data, len);
+    image_pos += len;
+}
+
+/* the whole pipeline: command, parsing, verification and unpacking, from a replayed upload */
+static void bench_capture(void)
+{
+    FPM_Sink out = { to_image, NULL };
+    FPM_Sink sink;
+    FPM_Unpacker unpacker;
+    FPM_Transfer summary;
+    double elapsed = 0;
+    char name[48];
+
+    fpm_unpacker_init(&unpacker, &out, &sink);
+    fpm_unpack_pixels_ref(packed_image, expected_image, FPM_IMAGE_PACKED_SZ);
+
+    say("\r\nImage capture (%dx%d) through fpm_fetch_image:\r\n", FPM_IMAGE_WIDTH, FPM_IMAGE_HEIGHT);
+    say("%8s %12s %14s %16s\r\n", "plen", "packets", "ms (host)", "ms (wire, est.)");
+
+    for (uint8_t plen = FPM_PLEN_32; plen <= FPM_PLEN_256; plen++) {
+        uint16_t chunk = fpm_packet_lengths[plen];
+        finger.sys_params.packet_len = plen;
+
+        for (int round = 0; round < CAPTURE_ROUNDS; round++) {
+            rx_len = rx_pos = 0;
+            queue_ack();
+            for (uint32_t pos = 0; pos < FPM_IMAGE_PACKED_SZ; pos += chunk)
+                queue_packet((pos + chunk >= FPM_IMAGE_PACKED_SZ) ? FPM_ENDDATAPACKET : FPM_DATAPACKET,
+                             &packed_image[pos], chunk);
+
+            image_pos = 0;
+            double start = now_sec();
+            int16_t rc = fpm_fetch_image(&finger, &sink, &summary);
+            elapsed += now_sec() - start;
+
+            if (rc != FPM_OK || image_pos != FPM_IMAGE_SZ || memcmp(image, expected_image, FPM_IMAGE_SZ) != 0) {
+                say("Capture failed: %d\r\n", rc);
+                return;
+            }
+        }
+
+        /* 10 bits per byte on the wire */
+        double wire_ms = (double)rx_len * 10 * 1000 / SENSOR_BAUD;
+
+        say("%8d %12u %14.3f %16.0f\r\n", chunk, summary.packets,
+                elapsed * 1000 / CAPTURE_ROUNDS, wire_ms);
+
+        snprintf(name, sizeof(name), "capture.plen%d", chunk);
+        result(name, "ms", elapsed * 1000 / CAPTURE_ROUNDS);
+        elapsed = 0;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-j") == 0)
+        json_output = 1;
+
+    for (int i = 0; i < TEMPLATE_SZ; i++)
+        template_buffer[i] = (uint8_t)(i * 7);
+
+    finger.address = FPM_DEFAULT_ADDRESS;
+    finger.password = FPM_DEFAULT_PASSWORD;
+    finger.manual_settings = 1;
+    finger.read_func = replay_read;
+    finger.write_func = count_write;
+    finger.avail_func = replay_avail;
+
+    for (int i = 0; i < FPM_IMAGE_PACKED_SZ; i++)
+        packed_image[i] = (uint8_t)(i * 13);
+
+    /* answer the password check */
+    queue_ack();
+    if (!fpm_begin(&finger, host_millis)) {
+        fprintf(stderr, "fpm_begin failed\n");
+        return 1;
+    }
+
+    if (json_output)
+        printf("{\n  \"benchmark\": \"fpm\",\n  \"results\": [");
+
+    bench_template_upload();
+    bench_template_download();
+    bench_checksum();
+    bench_commands();
+    bench_unpack();
+    bench_capture();
+
+    if (json_output)
+        printf("\n  ]\n}\n");
+
+    return 0;
+}
@@ -0,0 +1,625 @@
+/*
+ * fpm_emu.c
+ *
+ * Sensor emulator, see fpm_emu.h.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "fpm_emu.h"
+#include "fpm_image.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MATCH_SCORE         150
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t fpm_emu_millis(void)
+{
+    return (uint32_t)(now_us() / 1000);
+}
+
+/* 10 bits per byte on the wire */
+static uint64_t byte_time(FPM_Emu * emu)
+{
+    return emu->realtime ? 10 * 1000000 / fpm_baud_rate(emu->baud_rate) : 0;
+}
+
+static uint8_t line_matches(FPM_Emu * emu, uint8_t baud_rate)
+{
+    return emu->host_baud == 0 || emu->host_baud == fpm_baud_rate(baud_rate);
+}
+
+/*************** output queue ***************/
+
+static int queue_grow(FPM_Emu_Queue * q)
+{
+    uint32_t size = q->size ? q->size * 2 : 4096;
+    uint32_t count = q->tail - q->head;
+    uint8_t * bytes = malloc(size);
+    uint64_t * ready = malloc(size * sizeof(uint64_t));
+    uint8_t * baud = malloc(size);
+
+    if (bytes == NULL || ready == NULL || baud == NULL) {
+        free(bytes);
+        free(ready);
+        free(baud);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        bytes[i] = q->bytes[(q->head + i) % q->size];
+        ready[i] = q->ready[(q->head + i) % q->size];
+        baud[i] = q->baud[(q->head + i) % q->size];
+    }
+
+    free(q->bytes);
+    free(q->ready);
+    free(q->baud);
+    q->bytes = bytes;
+    q->ready = ready;
+    q->baud = baud;
+    q->head = 0;
+    q->tail = count;
+    q->size = size;
+    return 0;
+}
+
+static void queue_push(FPM_Emu_Queue * q, uint8_t byte, uint64_t ready, uint8_t baud_rate)
+{
+    if (q->tail - q->head == q->size && queue_grow(q) < 0)
+        return;
+
+    q->bytes[q->tail % q->size] = byte;
+    q->ready[q->tail % q->size] = ready;
+    q->baud[q->tail % q->size] = baud_rate;
+    q->tail++;
+}
+
+/* the time the last queued byte arrives, or 'now' if the line is idle */
+static uint64_t line_free(FPM_Emu * emu, uint64_t now)
+{
+    FPM_Emu_Queue * q = &emu->out;
+
+    if (q->tail == q->head)
+        return now;
+
+    uint64_t last = q->ready[(q->tail - 1) % q->size];
+    return (last > now) ? last : now;
+}
+
+static void send_packet(FPM_Emu * emu, uint8_t pid, const uint8_t * data, uint16_t len, uint64_t start)
+{
+    uint8_t header[FPM_PKT_HEADER_LEN];
+    uint16_t wire_len = len + 2;
+    uint16_t sum = pid + (wire_len >> 8) + (wire_len & 0xFF);
+    uint64_t per_byte = byte_time(emu);
+    uint64_t t = line_free(emu, start);
+
+    header[0] = FPM_STARTCODE >> 8; header[1] = FPM_STARTCODE & 0xFF;
+    header[2] = emu->address >> 24; header[3] = emu->address >> 16;
+    header[4] = emu->address >> 8; header[5] = emu->address;
+    header[6] = pid;
+    header[7] = wire_len >> 8; header[8] = wire_len & 0xFF;
+
+    for (uint16_t i = 0; i < FPM_PKT_HEADER_LEN; i++)
+        queue_push(&emu->out, header[i], t += per_byte, emu->baud_rate);
+
+    for (uint16_t i = 0; i < len; i++) {
+        sum += data[i];
+        queue_push(&emu->out, data[i], t += per_byte, emu->baud_rate);
+    }
+
+    queue_push(&emu->out, sum >> 8, t += per_byte, emu->baud_rate);
+    queue_push(&emu->out, sum & 0xFF, t += per_byte, emu->baud_rate);
+}
+
+static void send_ack(FPM_Emu * emu, uint8_t code, const uint8_t * data, uint16_t len, uint64_t start)
+{
+    uint8_t payload[1 + 32];
+
+    payload[0] = code;
+    memcpy(&payload[1], data, len);
+    send_packet(emu, FPM_ACKPACKET, payload, 1 + len, start);
+}
+
+/* splits 'data' into data packets of the current packet length */
+static void send_data(FPM_Emu * emu, const uint8_t * data, uint32_t len, uint64_t start)
+{
+    uint16_t chunk = fpm_packet_lengths[emu->packet_len];
+
+    for (uint32_t pos = 0; pos < len; pos += chunk) {
+        uint16_t n = (len - pos < chunk) ? len - pos : chunk;
+        send_packet(emu, (pos + n == len) ? FPM_ENDDATAPACKET : FPM_DATAPACKET, &data[pos], n, start);
+    }
+}
+
+/*************** fingers ***************/
+
+static uint32_t xorshift(uint32_t * state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void make_template(FPM_Emu * emu, uint32_t finger, uint8_t * out)
+{
+    uint32_t state = finger * 2654435761u + 1;
+
+    for (uint16_t i = 0; i < emu->template_size; i++)
+        out[i] = (uint8_t)xorshift(&state);
+}
+
+/* concentric ridges around a point that depends on the finger, 4 bits per pixel */
+static void make_image(uint32_t finger, uint8_t * packed)
+{
+    int cx = FPM_IMAGE_WIDTH / 2 + (int)(finger % 64) - 32;
+    int cy = FPM_IMAGE_HEIGHT / 2 + (int)(finger / 64 % 64) - 32;
+
+    for (int y = 0; y < FPM_IMAGE_HEIGHT; y++) {
+        for (int x = 0; x < FPM_IMAGE_WIDTH; x += 2) {
+            int d0 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+            int d1 = (x + 1 - cx) * (x + 1 - cx) + (y - cy) * (y - cy);
+            uint8_t p0 = (d0 / 40) & 0x0F;
+            uint8_t p1 = (d1 / 40) & 0x0F;
+            packed[(y * FPM_IMAGE_WIDTH + x) / 2] = (p0 << 4) | p1;
+        }
+    }
+}
+
+static uint8_t * slot_of(FPM_Emu * emu, uint8_t slot)
+{
+    return emu->slots[(slot == 2) ? 1 : 0];
+}
+
+static uint8_t is_empty(FPM_Emu * emu, const uint8_t * tmpl)
+{
+    for (uint16_t i = 0; i < emu->template_size; i++) {
+        if (tmpl[i] != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*************** commands ***************/
+
+static uint16_t get_u16(const uint8_t * p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t get_u32(const uint8_t * p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u16(uint8_t * p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+static void read_params(FPM_Emu * emu, uint8_t * out)
+{
+    put_u16(&out[0], 0);
+    put_u16(&out[2], emu->system_id);
+    put_u16(&out[4], emu->capacity);
+    put_u16(&out[6], emu->security_level);
+    out[8] = emu->address >> 24; out[9] = emu->address >> 16;
+    out[10] = emu->address >> 8; out[11] = emu->address;
+    put_u16(&out[12], emu->packet_len);
+    put_u16(&out[14], emu->baud_rate);
+}
+
+/* runs a command that arrived at time 'arrived' and queues its reply */
+static void run_command(FPM_Emu * emu, const uint8_t * cmd, uint16_t len, uint64_t arrived)
+{
+    FPM_Emu_Latency * lat = &emu->latency;
+    uint8_t reply[32];
+    uint16_t reply_len = 0;
+    uint8_t code = FPM_OK;
+    uint16_t work = lat->other;
+    const uint8_t * data = NULL;
+    uint32_t data_len = 0;
+
+    /* the opcode is all some commands have */
+    uint8_t args[12] = {0};
+    uint16_t args_len = len - 1;
+    if (args_len > sizeof(args))
+        args_len = sizeof(args);
+    memcpy(args, &cmd[1], args_len);
+
+    emu->commands++;
+
+    switch (cmd[0]) {
+        case FPM_VERIFYPASSWORD:
+            if (get_u32(args) != emu->password)
+                code = FPM_PASSFAIL;
+            break;
+        case FPM_SETPASSWORD:
+            emu->password = get_u32(args);
+            break;
+        case FPM_HANDSHAKE:
+            code = FPM_HANDSHAKE_OK;
+            break;
+        case FPM_READSYSPARAM:
+            read_params(emu, reply);
+            reply_len = 16;
+            break;
+        case FPM_SETSYSPARAM:
+            if (args[0] == FPM_SETPARAM_BAUD_RATE && args[1] >= FPM_BAUD_9600 && args[1] <= FPM_BAUD_115200) {
+                /* switched once the ACK is queued, below */
+            }
+            else if (args[0] == FPM_SETPARAM_SECURITY_LEVEL && args[1] >= FPM_FRR_1 && args[1] <= FPM_FRR_5)
+                emu->security_level = args[1];
+            else if (args[0] == FPM_SETPARAM_PACKET_LEN && args[1] <= FPM_PLEN_256)
+                emu->packet_len = args[1];
+            else
+                code = FPM_INVALIDREG;
+            break;
+        case FPM_GETIMAGE:
+        case FPM_GETIMAGE_NOLIGHT:
+            work = lat->get_image;
+            emu->image_finger = emu->finger;
+            if (emu->finger == 0)
+                code = FPM_NOFINGER;
+            break;
+        case FPM_IMAGE2TZ:
+            work = lat->image2tz;
+            if (emu->image_finger == 0)
+                code = FPM_INVALIDIMAGE;
+            else
+                make_template(emu, emu->image_finger, slot_of(emu, args[0]));
+            break;
+        case FPM_REGMODEL:
+            work = lat->regmodel;
+            if (memcmp(emu->slots[0], emu->slots[1], emu->template_size) != 0)
+                code = FPM_ENROLLMISMATCH;
+            break;
+        case FPM_STORE: {
+            uint16_t id = get_u16(&args[1]);
+            work = lat->store;
+            if (id >= emu->capacity) {
+                code = FPM_BADLOCATION;
+                break;
+            }
+            memcpy(&emu->database[(uint32_t)id * emu->template_size], slot_of(emu, args[0]), emu->template_size);
+            emu->occupied[id] = 1;
+            break;
+        }
+        case FPM_LOAD: {
+            uint16_t id = get_u16(&args[1]);
+            work = lat->load;
+            if (id >= emu->capacity) {
+                code = FPM_BADLOCATION;
+                break;
+            }
+            if (!emu->occupied[id]) {
+                code = FPM_DBREADFAIL;
+                break;
+            }
+            memcpy(slot_of(emu, args[0]), &emu->database[(uint32_t)id * emu->template_size], emu->template_size);
+            break;
+        }
+        case FPM_UPCHAR:
+            data = slot_of(emu, args[0]);
+            data_len = emu->template_size;
+            break;
+        case FPM_DOWNCHAR:
+            emu->receiving_slot = (args[0] == 2) ? 1 : 0;
+            emu->received = 0;
+            break;
+        case FPM_IMGUPLOAD:
+            if (emu->image_finger == 0) {
+                code = FPM_UPLOADFAIL;
+                break;
+            }
+            make_image(emu->image_finger, emu->image);
+            data = emu->image;
+            data_len = FPM_IMAGE_PACKED_SZ;
+            break;
+        case FPM_DELETE: {
+            uint16_t id = get_u16(&args[0]);
+            uint16_t count = get_u16(&args[2]);
+            work = lat->delete_model;
+            if ((uint32_t)id + count > emu->capacity) {
+                code = FPM_DELETEFAIL;
+                break;
+            }
+            memset(&emu->occupied[id], 0, count);
+            break;
+        }
+        case FPM_EMPTYDATABASE:
+            work = lat->empty_database;
+            memset(emu->occupied, 0, emu->capacity);
+            break;
+        case FPM_SEARCH:
+        case FPM_HISPEEDSEARCH: {
+            const uint8_t * probe = slot_of(emu, args[0]);
+            uint32_t start = get_u16(&args[1]);
+            uint32_t end = start + get_u16(&args[3]);
+            if (end > emu->capacity)
+                end = emu->capacity;
+
+            work = lat->search_page * ((emu->capacity + FPM_TEMPLATES_PER_PAGE - 1) / FPM_TEMPLATES_PER_PAGE);
+            code = FPM_NOTFOUND;
+
+            for (uint32_t id = start; id < end && !is_empty(emu, probe); id++) {
+                if (emu->occupied[id] &&
+                    memcmp(&emu->database[id * emu->template_size], probe, emu->template_size) == 0) {
+                    code = FPM_OK;
+                    put_u16(&reply[0], id);
+                    put_u16(&reply[2], MATCH_SCORE);
+                    reply_len = 4;
+                    break;
+                }
+            }
+
+            if (code != FPM_OK) {
+                memset(reply, 0, 4);
+                reply_len = 4;
+            }
+            break;
+        }
+        case FPM_PAIRMATCH:
+            code = memcmp(emu->slots[0], emu->slots[1], emu->template_size) == 0 ? FPM_OK : FPM_NOMATCH;
+            put_u16(reply, (code == FPM_OK) ? MATCH_SCORE : 0);
+            reply_len = 2;
+            break;
+        case FPM_TEMPLATECOUNT: {
+            uint16_t count = 0;
+            for (uint16_t id = 0; id < emu->capacity; id++)
+                count += emu->occupied[id];
+            put_u16(reply, count);
+            reply_len = 2;
+            break;
+        }
+        case FPM_READTEMPLATEINDEX:
+            memset(reply, 0, 32);
+            for (uint16_t i = 0; i < FPM_TEMPLATES_PER_PAGE; i++) {
+                uint32_t id = (uint32_t)args[0] * FPM_TEMPLATES_PER_PAGE + i;
+                if (id < emu->capacity && emu->occupied[id])
+                    reply[i / 8] |= 1 << (i % 8);
+            }
+            reply_len = 32;
+            break;
+        case FPM_GETRANDOM: {
+            uint32_t r = (uint32_t)rand();
+            reply[0] = r >> 24; reply[1] = r >> 16; reply[2] = r >> 8; reply[3] = r;
+            reply_len = 4;
+            break;
+        }
+        case FPM_STANDBY:
+        case FPM_LEDON:
+        case FPM_LEDOFF:
+            break;
+        default:
+            code = FPM_PACKETRECIEVEERR;
+            break;
+    }
+
+    uint64_t start = (arrived > emu->busy_until) ? arrived : emu->busy_until;
+    if (emu->realtime)
+        start += (uint64_t)work * 1000;
+    emu->busy_until = start;
+
+    send_ack(emu, code, reply, reply_len, start);
+
+    if (code == FPM_OK && data != NULL)
+        send_data(emu, data, data_len, start);
+
+    /* the ACK goes out at the old rate */
+    if (code == FPM_OK && cmd[0] == FPM_SETSYSPARAM && args[0] == FPM_SETPARAM_BAUD_RATE)
+        emu->baud_rate = args[1];
+}
+
+static void on_packet(void * ctx, uint8_t pid, uint8_t * data, uint16_t len)
+{
+    FPM_Emu * emu = (FPM_Emu *)ctx;
+
+    if (pid == FPM_COMMANDPACKET && len > 0) {
+        run_command(emu, data, len, emu->rx_free);
+        return;
+    }
+
+    if ((pid == FPM_DATAPACKET || pid == FPM_ENDDATAPACKET) && emu->receiving_slot >= 0) {
+        uint8_t * slot = emu->slots[emu->receiving_slot];
+        uint16_t room = emu->template_size - emu->received;
+        uint16_t n = (len < room) ? len : room;
+
+        memcpy(&slot[emu->received], data, n);
+        emu->received += n;
+
+        if (pid == FPM_ENDDATAPACKET)
+            emu->receiving_slot = -1;
+    }
+}
+
+/*************** transport ***************/
+
+void fpm_emu_write(FPM_Emu * emu, const uint8_t * bytes, uint16_t len)
+{
+    if (!line_matches(emu, emu->baud_rate))
+        return;
+
+    uint64_t now = now_us();
+    if (emu->rx_free < now)
+        emu->rx_free = now;
+    emu->rx_free += len * byte_time(emu);
+
+    fpm_parser_feed(&emu->parser, bytes, len);
+}
+
+uint16_t fpm_emu_avail(FPM_Emu * emu)
+{
+    FPM_Emu_Queue * q = &emu->out;
+    uint64_t now = emu->realtime ? now_us() : UINT64_MAX;
+    uint32_t n = 0;
+
+    while (q->head + n != q->tail && q->ready[(q->head + n) % q->size] <= now && n < 0xFFFF) {
+        if (line_matches(emu, q->baud[(q->head + n) % q->size])) {
+            n++;
+            continue;
+        }
+
+        /* sent at another baud rate: garbage to the host's UART, as good as lost */
+        if (n != 0)
+            break;
+        q->head++;
+    }
+
+    return n;
+}
+
+uint16_t fpm_emu_read(FPM_Emu * emu, uint8_t * bytes, uint16_t len)
+{
+    FPM_Emu_Queue * q = &emu->out;
+    uint16_t avail = fpm_emu_avail(emu);
+
+    if (len > avail)
+        len = avail;
+
+    for (uint16_t i = 0; i < len; i++)
+        bytes[i] = q->bytes[(q->head + i) % q->size];
+
+    q->head += len;
+    return len;
+}
+
+int64_t fpm_emu_next_ready(FPM_Emu * emu)
+{
+    FPM_Emu_Queue * q = &emu->out;
+
+    if (q->head == q->tail)
+        return -1;
+
+    if (!emu->realtime)
+        return 0;
+
+    uint64_t ready = q->ready[q->head % q->size];
+    uint64_t now = now_us();
+
+    return (ready > now) ? (int64_t)(ready - now) : 0;
+}
+
+static void sleep_until(uint64_t when)
+{
+    uint64_t now = now_us();
+
+    if (when <= now)
+        return;
+
+    struct timespec ts = { (time_t)((when - now) / 1000000), (long)((when - now) % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) < 0);
+}
+
+uint16_t fpm_emu_wait(FPM_Emu * emu, uint16_t min_bytes, uint16_t timeout)
+{
+    FPM_Emu_Queue * q = &emu->out;
+    uint32_t queued = q->tail - q->head;
+
+    if (!emu->realtime || min_bytes == 0)
+        return fpm_emu_avail(emu);
+
+    /* replies are queued whole as the command comes in, so when their bytes arrive is known already */
+    uint64_t wake = now_us() + (uint64_t)timeout * 1000;
+
+    if (queued > 0) {
+        uint32_t last = (min_bytes < queued) ? min_bytes : queued;
+        uint64_t ready = q->ready[(q->head + last - 1) % q->size];
+
+        if (ready < wake)
+            wake = ready;
+    }
+
+    sleep_until(wake);
+    return fpm_emu_avail(emu);
+}
+
+void fpm_emu_sleep(uint16_t ms)
+{
+    /* 0 only asks to yield */
+    sleep_until(now_us() + (ms ? (uint64_t)ms * 1000 : 100));
+}
+
+void fpm_emu_enroll(FPM_Emu * emu, uint16_t id, uint32_t finger)
+{
+    if (id >= emu->capacity)
+        return;
+
+    make_template(emu, finger, &emu->database[(uint32_t)id * emu->template_size]);
+    emu->occupied[id] = 1;
+}
+
+int fpm_emu_init(FPM_Emu * emu, uint16_t capacity, uint16_t template_size)
+{
+    memset(emu, 0, sizeof(FPM_Emu));
+
+    emu->address = FPM_DEFAULT_ADDRESS;
+    emu->password = FPM_DEFAULT_PASSWORD;
+    emu->capacity = capacity;
+    emu->template_size = template_size;
+    emu->system_id = 0x0009;
+    emu->security_level = FPM_FRR_3;
+    emu->packet_len = FPM_PLEN_128;
+    emu->baud_rate = FPM_BAUD_57600;
+    emu->receiving_slot = -1;
+
+    /* roughly those of an R307 */
+    emu->realtime = 1;
+    emu->latency.get_image = 150;
+    emu->latency.image2tz = 300;
+    emu->latency.regmodel = 40;
+    emu->latency.store = 25;
+    emu->latency.load = 10;
+    emu->latency.delete_model = 25;
+    emu->latency.empty_database = 100;
+    emu->latency.search_page = 40;
+    emu->latency.other = 1;
+
+    emu->database = calloc(capacity, template_size);
+    emu->occupied = calloc(capacity, 1);
+    emu->slots[0] = calloc(1, template_size);
+    emu->slots[1] = calloc(1, template_size);
+    emu->image = malloc(FPM_IMAGE_PACKED_SZ);
+
+    if (emu->database == NULL || emu->occupied == NULL || emu->slots[0] == NULL || emu->slots[1] == NULL ||
+        emu->image == NULL) {
+        fpm_emu_free(emu);
+        return -1;
+    }
+
+    fpm_parser_init(&emu->parser, emu->address, emu->payload, sizeof(emu->payload), on_packet, emu);
+    return 0;
+}
+
+void fpm_emu_free(FPM_Emu * emu)
+{
+    free(emu->database);
+    free(emu->occupied);
+    free(emu->slots[0]);
+    free(emu->slots[1]);
+    free(emu->image);
+    free(emu->out.bytes);
+    free(emu->out.ready);
+    free(emu->out.baud);
+
+    emu->database = emu->occupied = NULL;
+    emu->slots[0] = emu->slots[1] = NULL;
+    emu->image = NULL;
+    emu->out.bytes = NULL;
+    emu->out.ready = NULL;
+    emu->out.baud = NULL;
+}
@@ -0,0 +1,129 @@
+/*
+ * fpm_emu.h
+ *
+ * A sensor emulator speaking the protocol in fpm.h, for benchmarks and tests without hardware.
+ * It runs in-process (FPM_EMU_PORT) or behind a pseudo-terminal (see fpm_emud.c).
+ *
+ * Templates are derived from the "finger" on the sensor, so the same finger always
+ * gives the same template and searches and matches work as they would on a real module.
+ */
+
+#ifndef FPM_EMU_H_
+#define FPM_EMU_H_
+
+#include "fpm.h"
+
+#include <stdint.h>
+
+/* processing time of each command, in ms */
+typedef struct {
+    uint16_t get_image;
+    uint16_t image2tz;
+    uint16_t regmodel;
+    uint16_t store;
+    uint16_t load;
+    uint16_t delete_model;
+    uint16_t empty_database;
+    /* for each 256 templates searched */
+    uint16_t search_page;
+    uint16_t other;
+} FPM_Emu_Latency;
+
+typedef struct {
+    /* output bytes, the time (us) each one has fully arrived on the wire, and the FPM_BAUD_* it was sent at */
+    uint8_t * bytes;
+    uint64_t * ready;
+    uint8_t * baud;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+} FPM_Emu_Queue;
+
+typedef struct {
+    uint32_t address;
+    uint32_t password;
+    uint16_t capacity;
+    uint16_t template_size;
+    uint16_t system_id;
+    uint16_t security_level;
+    uint8_t packet_len;         /* FPM_PLEN_* */
+    uint8_t baud_rate;          /* FPM_BAUD_* */
+
+    /* the finger on the sensor, 0 for none. Any other value stands for one particular finger */
+    uint32_t finger;
+
+    /* set to 0 to answer at once, for tests */
+    uint8_t realtime;
+    FPM_Emu_Latency latency;
+
+    /* what the host's UART is set to, in bits/s. If it differs from the sensor's,
+       nothing gets through, as on a real line. 0 to always match */
+    uint32_t host_baud;
+
+    /* internal state */
+    FPM_Parser parser;
+    uint8_t payload[FPM_MAX_PACKET_LEN];
+    FPM_Emu_Queue out;
+
+    uint8_t * database;
+    uint8_t * occupied;
+    uint8_t * slots[2];
+    uint8_t * image;
+    uint32_t image_finger;
+
+    /* DOWNCHAR in progress: where the data packets go */
+    int8_t receiving_slot;
+    uint16_t received;
+
+    /* when the line from the host is next free, and when the sensor is done with the last command */
+    uint64_t rx_free;
+    uint64_t busy_until;
+
+    uint32_t commands;
+} FPM_Emu;
+
+/* a sensor with 'capacity' templates of 'template_size' bytes, at the factory defaults.
+   Returns 0, or -1 if out of memory */
+int fpm_emu_init(FPM_Emu * emu, uint16_t capacity, uint16_t template_size);
+void fpm_emu_free(FPM_Emu * emu);
+
+/* bytes from the host */
+void fpm_emu_write(FPM_Emu * emu, const uint8_t * bytes, uint16_t len);
+
+/* bytes for the host that have arrived by now */
+uint16_t fpm_emu_avail(FPM_Emu * emu);
+uint16_t fpm_emu_read(FPM_Emu * emu, uint8_t * bytes, uint16_t len);
+
+/* us until the next output byte arrives, -1 if there's none pending */
+int64_t fpm_emu_next_ready(FPM_Emu * emu);
+
+/* for the FPM's 'wait_func' and 'sleep_func': sleeps until 'min_bytes' have arrived or 'timeout' ms are up */
+uint16_t fpm_emu_wait(FPM_Emu * emu, uint16_t min_bytes, uint16_t timeout);
+void fpm_emu_sleep(uint16_t ms);
+
+/* fills a database slot directly, with the template of 'finger' */
+void fpm_emu_enroll(FPM_Emu * emu, uint16_t id, uint32_t finger);
+
+uint32_t fpm_emu_millis(void);
+
+/* The library calls its transport functions without a context, so this generates
+   an emulator named 'name' and the functions for it, to be hooked up with FPM_EMU_ATTACH.
+   Use it once per emulated sensor, at file scope */
+#define FPM_EMU_PORT(name) \
+    static FPM_Emu name; \
+    static uint16_t name##_read(uint8_t * bytes, uint16_t len) { return fpm_emu_read(&name, bytes, len); } \
+    static void name##_write(uint8_t * bytes, uint16_t len) { fpm_emu_write(&name, bytes, len); } \
+    static uint16_t name##_avail(void) { return fpm_emu_avail(&name); } \
+    static void name##_set_baud(uint32_t baud) { name.host_baud = baud; } \
+    static uint16_t name##_wait(uint16_t min_bytes, uint16_t timeout) { return fpm_emu_wait(&name, min_bytes, timeout); }
+
+#define FPM_EMU_ATTACH(fpm, name) do { \
+        (fpm)->read_func = name##_read; \
+        (fpm)->write_func = name##_write; \
+        (fpm)->avail_func = name##_avail; \
+        (fpm)->set_baud_func = name##_set_baud; \
+        (fpm)->wait_func = name##_wait; \
+        (fpm)->sleep_func = fpm_emu_sleep; \
+    } while (0)
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * fpm_emud.c
+ *
+ * Runs the sensor emulator behind a pseudo-terminal, so that any program
+ * (e.g. fpmtool) can open it like a serial port.
+ *
+ * Build with:
+ *     gcc -O2 -I../../src ../../src/fpm.c fpm_emu.c fpm_emud.c -o fpm_emud
+ *
+ * Usage:
+ *     fpm_emud [-c capacity] [-t template_size] [-f finger] [-e enrolled] [-n]
+ *
+ *     -f  finger on the sensor, 0 for none (default 1)
+ *     -e  fills IDs 0..enrolled-1 with fingers 1..enrolled
+ *     -n  no latency, answer at once
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include "fpm_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+static FPM_Emu emu;
+
+static int open_pty(void)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    struct termios tio;
+
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0)
+        return -1;
+
+    /* raw, so no byte gets translated on the way */
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+    return fd;
+}
+
+int main(int argc, char ** argv)
+{
+    uint16_t capacity = 1000;
+    uint16_t template_size = 768;
+    uint32_t finger = 1;
+    uint16_t enrolled = 0;
+    uint8_t realtime = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:f:e:n")) != -1) {
+        switch (opt) {
+            case 'c': capacity = atoi(optarg); break;
+            case 't': template_size = atoi(optarg); break;
+            case 'f': finger = strtoul(optarg, NULL, 10); break;
+            case 'e': enrolled = atoi(optarg); break;
+            case 'n': realtime = 0; break;
+            default:
+                fprintf(stderr, "Usage: fpm_emud [-c capacity] [-t template_size] [-f finger] [-e enrolled] [-n]\n");
+                return 2;
+        }
+    }
+
+    if (fpm_emu_init(&emu, capacity, template_size) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    emu.finger = finger;
+    emu.realtime = realtime;
+
+    for (uint16_t id = 0; id < enrolled; id++)
+        fpm_emu_enroll(&emu, id, id + 1);
+
+    int fd = open_pty();
+    if (fd < 0) {
+        perror("pty");
+        return 1;
+    }
+
+    printf("%s\n", ptsname(fd));
+    fflush(stdout);
+
+    uint8_t buf[1024];
+
+    while (1) {
+        /* wake up for the host, or when the next reply byte is due */
+        int64_t next = fpm_emu_next_ready(&emu);
+        int timeout = (next < 0) ? -1 : (int)((next + 999) / 1000);
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        poll(&pfd, 1, timeout);
+
+        if (pfd.revents & POLLIN) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n > 0)
+                fpm_emu_write(&emu, buf, (uint16_t)n);
+        }
+
+        /* nobody has the other end open yet */
+        if (pfd.revents & POLLHUP)
+            usleep(10000);
+
+        uint16_t n = fpm_emu_read(&emu, buf, sizeof(buf));
+        if (n > 0 && write(fd, buf, n) < 0)
+            break;
+    }
+
+    fpm_emu_free(&emu);
+    return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * fpmtool.c
+ *
+ * Talks to a sensor on a serial port from a Linux (or other POSIX) host.
+ *
+ * Build with:
+ *     gcc -O2 -I../../src ../../src/fpm.c ../../src/fpm_image.c ../../src/fpm_posix.c ../../src/fpm_capture.c \
+ *         fpmtool.c -o fpmtool
+ *
+ * Usage:
+ *     fpmtool <port> [-b baud] [-w capture] [-t] info
+ *     fpmtool <port> [-b baud] [-w capture] [-t] image <file.pgm>
+ *     fpmtool <port> [-b baud] [-w capture] [-t] fetch <id> <file>
+ *     fpmtool <port> [-b baud] [-w capture] [-t] push <id> <file>
+ *
+ *     -w  records all UART traffic to 'capture'
+ *     -t  prints the last protocol events at the end; build everything with -DFPM_ENABLE_TRACE
+ *         and add ../../src/fpm_trace.c for it
+ *
+ *     fpmtool -r <capture> [-s speedup] [-t] <command>
+ *
+ *     replays a capture instead of talking to a sensor, 'speedup' times faster
+ *     (0 for no delays at all). The command must be the one that was recorded.
+ */
+
+#include "fpm.h"
+#include "fpm_image.h"
+#include "fpm_posix.h"
+#include "fpm_capture.h"
+
+#if defined(FPM_ENABLE_TRACE)
+    #include "fpm_trace.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* the largest template we know of */
+#define MAX_TEMPLATE_SZ     1024
+
+FPM_POSIX_PORT(sensor_port)
+FPM_RECORDER_PORT(recorder)
+FPM_REPLAY_PORT(replay)
+
+static FPM finger;
+
+static void to_file(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last)
+{
+    (void)is_last;
+    fwrite(data, 1, len, (FILE *)ctx);
+}
+
+static uint16_t from_file(void * ctx, uint8_t * buf, uint16_t len)
+{
+    return (uint16_t)fread(buf, 1, len, (FILE *)ctx);
+}
+
+static int cmd_info(void)
+{
+    FPM_System_Params params;
+    uint16_t count = 0;
+
+    if (fpm_read_params(&finger, &params) != FPM_OK) {
+        printf("Could not read the parameters\n");
+        return 1;
+    }
+
+    fpm_get_template_count(&finger, &count);
+
+    printf("System ID: 0x%X\n", params.system_id);
+    printf("Capacity: %d\n", params.capacity);
+    printf("Templates: %d\n", count);
+    printf("Security level: %d\n", params.security_level);
+    printf("Packet length: %d\n", fpm_packet_lengths[params.packet_len]);
+    printf("Baud rate: %lu\n", (unsigned long)fpm_baud_rate(params.baud_rate));
+    return 0;
+}
+
+static int cmd_image(const char * path)
+{
+    static FPM_Unpacker unpacker;
+    FPM_Sink sink;
+    FPM_Transfer summary;
+    char header[FPM_PGM_HEADER_MAX];
+
+    FILE * f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    FPM_Sink out = { to_file, f };
+    fpm_unpacker_init(&unpacker, &out, &sink);
+
+    printf("Place a finger on the sensor...\n");
+    while (fpm_get_image(&finger) != FPM_OK);
+
+    fwrite(header, 1, fpm_pgm_header(header, FPM_IMAGE_WIDTH, FPM_IMAGE_HEIGHT), f);
+
+    int16_t rc = fpm_fetch_image(&finger, &sink, &summary);
+    fclose(f);
+
+    if (rc != FPM_OK) {
+        printf("Image upload failed: %d\n", rc);
+        return 1;
+    }
+
+    printf("%u bytes in %lu ms\n", summary.bytes, (unsigned long)summary.elapsed);
+    return 0;
+}
+
+static int cmd_fetch(uint16_t id, const char * path)
+{
+    FPM_Transfer summary;
+
+    FILE * f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    FPM_Sink sink = { to_file, f };
+    int16_t rc = fpm_fetch_template(&finger, id, &sink, &summary);
+    fclose(f);
+
+    if (rc != FPM_OK) {
+        printf("Fetching template %d failed: %d\n", id, rc);
+        return 1;
+    }
+
+    printf("%u bytes in %lu ms, CRC-32: 0x%08lX\n", summary.bytes,
+            (unsigned long)summary.elapsed, (unsigned long)summary.crc);
+    return 0;
+}
+
+static int cmd_push(uint16_t id, const char * path)
+{
+    FPM_Transfer summary;
+
+    FILE * f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    rewind(f);
+
+    if (len <= 0 || len > MAX_TEMPLATE_SZ) {
+        printf("%s doesn't look like a template\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    FPM_Source source = { from_file, f };
+    int16_t rc = fpm_push_template(&finger, id, &source, (uint16_t)len, &summary);
+    fclose(f);
+
+    if (rc != FPM_OK) {
+        printf("Pushing template %d failed: %d\n", id, rc);
+        return 1;
+    }
+
+    printf("%u bytes in %lu ms, CRC-32: 0x%08lX\n", summary.bytes,
+            (unsigned long)summary.elapsed, (unsigned long)summary.crc);
+    return 0;
+}
+
+static int usage(void)
+{
+    printf("Usage: fpmtool <port> [-b baud] [-w capture] [-t] <command>\n"
+           "       fpmtool -r <capture> [-s speedup] [-t] <command>\n"
+           "Commands: info | image <file.pgm> | fetch <id> <file> | push <id> <file>\n");
+    return 2;
+}
+
+#if defined(FPM_ENABLE_TRACE)
+static void print_trace(void)
+{
+    FPM_Trace_Event events[FPM_TRACE_LEN];
+    uint32_t dropped;
+    char line[96];
+
+    uint16_t n = fpm_trace_read(&finger, events, FPM_TRACE_LEN, &dropped);
+    if (dropped > 0)
+        printf("(%lu earlier events dropped)\n", (unsigned long)dropped);
+
+    for (uint16_t i = 0; i < n; i++) {
+        fpm_trace_format(&events[i], line, sizeof(line));
+        printf("%s\n", line);
+    }
+}
+#endif
+
+static uint8_t * load_file(const char * path, uint32_t * len)
+{
+    FILE * f = fopen(path, "rb");
+    uint8_t * data = NULL;
+
+    if (f == NULL)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+
+    if (size > 0 && (data = malloc(size)) != NULL && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(f);
+    *len = (uint32_t)size;
+    return data;
+}
+
+int main(int argc, char ** argv)
+{
+    uint32_t baud = 57600;
+    const char * capture_path = NULL;
+    uint8_t * capture = NULL;
+    uint32_t capture_len = 0;
+    FILE * capture_file = NULL;
+    uint16_t speedup = 1;
+    uint8_t replaying;
+    uint8_t tracing = 0;
+    int arg = 2;
+
+    if (argc < 3)
+        return usage();
+
+    replaying = (strcmp(argv[1], "-r") == 0);
+    if (replaying)
+        arg = 3;
+
+    while (arg + 1 < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-t") == 0) {
+            tracing = 1;
+            arg++;
+            continue;
+        }
+
+        if (strcmp(argv[arg], "-b") == 0)
+            baud = strtoul(argv[arg + 1], NULL, 10);
+        else if (strcmp(argv[arg], "-w") == 0)
+            capture_path = argv[arg + 1];
+        else if (strcmp(argv[arg], "-s") == 0)
+            speedup = (uint16_t)atoi(argv[arg + 1]);
+        else
+            return usage();
+
+        arg += 2;
+    }
+
+    if (arg >= argc)
+        return usage();
+
+    finger.address = FPM_DEFAULT_ADDRESS;
+    finger.password = FPM_DEFAULT_PASSWORD;
+    finger.manual_settings = 0;
+
+#if defined(FPM_ENABLE_TRACE)
+    finger.trace.clock_func = fpm_posix_micros;
+#else
+    if (tracing) {
+        printf("-t needs a build with -DFPM_ENABLE_TRACE\n");
+        return 2;
+    }
+#endif
+
+    if (replaying) {
+        capture = load_file(argv[2], &capture_len);
+
+        if (capture == NULL || fpm_replay_init(&replay, capture, capture_len, fpm_posix_micros, speedup) < 0) {
+            printf("%s is not a capture\n", argv[2]);
+            return 1;
+        }
+
+        FPM_REPLAY_ATTACH(&finger, replay);
+        finger.sleep_func = fpm_posix_sleep;
+    }
+    else {
+        if (fpm_posix_open(&sensor_port, argv[1], baud) < 0) {
+            printf("%s: %s\n", argv[1], strerror(errno));
+            return 1;
+        }
+
+        FPM_POSIX_ATTACH(&finger, sensor_port);
+    }
+
+    if (capture_path != NULL) {
+        capture_file = fopen(capture_path, "wb");
+        if (capture_file == NULL) {
+            perror(capture_path);
+            return 1;
+        }
+
+        static FPM_Sink capture_sink;
+        capture_sink.func = to_file;
+        capture_sink.ctx = capture_file;
+
+        fpm_recorder_init(&recorder, &capture_sink, fpm_posix_micros);
+        FPM_RECORDER_ATTACH(&finger, recorder);
+    }
+
+    /* a serial port driver buffers far more than any packet */
+    finger.rx_capacity = 0;
+
+    if (!fpm_begin(&finger, fpm_posix_millis)) {
+        printf("Did not find fingerprint sensor :(\n");
+        return 1;
+    }
+
+    const char * cmd = argv[arg++];
+    uint32_t start = fpm_posix_micros();
+    int rc;
+
+    if (strcmp(cmd, "info") == 0)
+        rc = cmd_info();
+    else if (strcmp(cmd, "image") == 0 && argc - arg == 1)
+        rc = cmd_image(argv[arg]);
+    else if (strcmp(cmd, "fetch") == 0 && argc - arg == 2)
+        rc = cmd_fetch((uint16_t)atoi(argv[arg]), argv[arg + 1]);
+    else if (strcmp(cmd, "push") == 0 && argc - arg == 2)
+        rc = cmd_push((uint16_t)atoi(argv[arg]), argv[arg + 1]);
+    else
+        rc = usage();
+
+#if defined(FPM_ENABLE_TRACE)
+    if (tracing)
+        print_trace();
+#endif
+
+    if (capture_file != NULL) {
+        fpm_recorder_finish(&recorder);
+        fclose(capture_file);
+        printf("Recorded %lu transfers, %lu bytes\n", (unsigned long)recorder.records, (unsigned long)recorder.bytes);
+    }
+
+    if (replaying) {
+        printf("Replayed in %lu us, %lu mismatched writes%s\n",
+                (unsigned long)(fpm_posix_micros() - start), (unsigned long)replay.mismatches,
+                fpm_replay_done(&replay) ? "" : ", capture not finished");
+        free(capture);
+    }
+    else {
+        fpm_posix_close(&sensor_port);
+    }
+
+    return rc;
+}
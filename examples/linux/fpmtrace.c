@@ -0,0 +1,41 @@
+/*
+ * fpmtrace.c
+ *
+ * Decodes trace events dumped from a device, as packed by fpm_trace_pack(),
+ * e.g. after copying the FPM trace ring to flash or out of a UART.
+ *
+ * Build with:
+ *     gcc -O2 -I../../src ../../src/fpm.c ../../src/fpm_trace.c fpmtrace.c -o fpmtrace
+ *
+ * Usage:
+ *     fpmtrace [dump]      (reads stdin without one)
+ */
+
+#include "fpm.h"
+#include "fpm_trace.h"
+
+#include <stdio.h>
+
+int main(int argc, char ** argv)
+{
+    FILE * f = stdin;
+    uint8_t packed[FPM_TRACE_PACKED_SZ];
+    FPM_Trace_Event event;
+    char line[96];
+
+    if (argc > 1 && (f = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    while (fread(packed, 1, sizeof(packed), f) == sizeof(packed)) {
+        fpm_trace_unpack(&event, packed);
+        fpm_trace_format(&event, line, sizeof(line));
+        printf("%s\n", line);
+    }
+
+    if (f != stdin)
+        fclose(f);
+
+    return 0;
+}
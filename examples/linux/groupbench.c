@@ -0,0 +1,193 @@
+/*
+ * groupbench.c
+ *
+ * 1:N identification over a group of emulated sensors (see fpm_group.h),
+ * reporting latency and throughput as the group grows from 1 to 8 sensors.
+ * The first sensor is the reader; each round puts an enrolled finger on it,
+ * captures the template and searches the whole group for it.
+ *
+ * Build with:
+ *     gcc -O2 -I../../src ../../src/fpm.c ../../src/fpm_group.c ../../src/fpm_image.c fpm_emu.c groupbench.c -o groupbench
+ *
+ * Usage:
+ *     groupbench [-c capacity] [-r rounds]
+ */
+
+#include "fpm.h"
+#include "fpm_group.h"
+#include "fpm_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TEMPLATE_SZ         768
+#define SENSORS             FPM_GROUP_MAX_SENSORS
+
+/* fingers are numbered after the global ID they're enrolled under */
+#define FINGER(id)          (1000u + (id))
+
+/* one emulator per sensor, each with its own set of transport functions */
+#define SENSOR(n) \
+    FPM_EMU_PORT(emu##n) \
+    static void attach##n(FPM * fpm) { FPM_EMU_ATTACH(fpm, emu##n); }
+
+SENSOR(0) SENSOR(1) SENSOR(2) SENSOR(3) SENSOR(4) SENSOR(5) SENSOR(6) SENSOR(7)
+
+static struct {
+    FPM_Emu * emu;
+    void (*attach)(FPM * fpm);
+} ports[SENSORS] = {
+    { &emu0, attach0 }, { &emu1, attach1 }, { &emu2, attach2 }, { &emu3, attach3 },
+    { &emu4, attach4 }, { &emu5, attach5 }, { &emu6, attach6 }, { &emu7, attach7 },
+};
+
+static FPM sensors[SENSORS];
+static FPM_Group group;
+
+static uint32_t rng_state = 2463534242u;
+
+static uint32_t next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/* puts 'finger' on the reader and searches the group for it */
+static int16_t identify(uint32_t finger, uint16_t * id, uint16_t * score)
+{
+    FPM * reader = &sensors[0];
+
+    emu0.finger = finger;
+
+    int16_t rc = fpm_get_image(reader);
+    if (rc == FPM_OK)
+        rc = fpm_image2Tz(reader, 1);
+    if (rc == FPM_OK)
+        rc = fpm_group_search(&group, 0, 1, id, score);
+
+    return rc;
+}
+
+/* enrolls on the reader and stores through the group, which copies the template to the right sensor */
+static int check_store(void)
+{
+    uint16_t last = group.capacity - 1;
+    uint16_t id, score;
+
+    emu0.finger = FINGER(last);
+
+    if (fpm_get_image(&sensors[0]) != FPM_OK || fpm_image2Tz(&sensors[0], 1) != FPM_OK ||
+            fpm_group_store_model(&group, 0, 1, last) != FPM_OK) {
+        printf("storing #%u failed\n", last);
+        return -1;
+    }
+
+    if (identify(FINGER(last), &id, &score) != FPM_OK || id != last) {
+        printf("#%u not found after storing it\n", last);
+        return -1;
+    }
+
+    if (fpm_group_delete_model(&group, last) != FPM_OK || identify(FINGER(last), &id, &score) != FPM_NOTFOUND) {
+        printf("#%u still found after deleting it\n", last);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    uint16_t capacity = 1000;
+    int rounds = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:")) != -1) {
+        switch (opt) {
+            case 'c': capacity = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: groupbench [-c capacity] [-r rounds]\n");
+                return 2;
+        }
+    }
+
+    if (capacity < 1 || capacity > 0xFFFF / SENSORS || rounds < 1) {
+        fprintf(stderr, "1 to %d templates per sensor, at least one round\n", 0xFFFF / SENSORS);
+        return 2;
+    }
+
+    printf("Bringing up %d sensors of %u templates...\n", SENSORS, capacity);
+
+    for (int i = 0; i < SENSORS; i++) {
+        FPM * fpm = &sensors[i];
+
+        if (fpm_emu_init(ports[i].emu, capacity, TEMPLATE_SZ) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        /* every tenth ID is taken */
+        for (uint16_t id = 0; id < capacity; id += 10)
+            fpm_emu_enroll(ports[i].emu, id, FINGER(i * capacity + id));
+
+        ports[i].attach(fpm);
+        fpm->address = FPM_DEFAULT_ADDRESS;
+        fpm->password = FPM_DEFAULT_PASSWORD;
+        fpm->auto_link = 1;
+
+        if (!fpm_begin(fpm, fpm_emu_millis)) {
+            printf("sensor %d: fpm_begin failed\n", i);
+            return 1;
+        }
+    }
+
+    /* identify: capture, distribution and search, as seen by the user at the door */
+    printf("\n%-8s %-10s %-14s %-10s %-12s %-10s %-8s %s\n", "sensors", "templates",
+            "distribute ms", "search ms", "identify ms", "worst ms", "ids/s", "templates/s");
+
+    for (int n = 1; n <= SENSORS; n *= 2) {
+        uint64_t distribute = 0, search = 0, total = 0;
+        uint32_t worst = 0;
+
+        fpm_group_init(&group);
+        for (int i = 0; i < n; i++)
+            fpm_group_add(&group, &sensors[i]);
+
+        if (check_store() < 0)
+            return 1;
+
+        for (int round = 0; round < rounds; round++) {
+            uint16_t target = (next_random() % (group.capacity / 10)) * 10;
+            uint16_t id = 0, score = 0;
+
+            uint32_t start = fpm_emu_millis();
+            int16_t rc = identify(FINGER(target), &id, &score);
+            uint32_t elapsed = fpm_emu_millis() - start;
+
+            if (rc != FPM_OK || id != target) {
+                printf("%d sensors: looking for #%u, got #%u (code %d)\n", n, target, id, rc);
+                return 1;
+            }
+
+            distribute += group.distribute_ms;
+            search += group.search_ms;
+            total += elapsed;
+            if (elapsed > worst)
+                worst = elapsed;
+        }
+
+        double mean = (double)total / rounds;
+
+        printf("%-8d %-10u %-14.1f %-10.1f %-12.1f %-10lu %-8.2f %.0f\n", n, group.capacity,
+                (double)distribute / rounds, (double)search / rounds, mean, (unsigned long)worst,
+                1000.0 / mean, group.capacity * 1000.0 / mean);
+    }
+
+    for (int i = 0; i < SENSORS; i++)
+        fpm_emu_free(ports[i].emu);
+
+    return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * selftest.c
+ *
+ * Regression tests for the library against an emulated sensor: timeouts
+ * with latencies that change from one call to the next, late replies,
+ * transmissions that never complete, and the template index cache.
+ * Prints one line per test and exits with 1 if any of them failed.
+ *
+ * Build with:
+ *     gcc -O2 -DFPM_ENABLE_INDEX_CACHE -I../../src ../../src/fpm.c ../../src/fpm_image.c fpm_emu.c selftest.c -o selftest
+ *
+ * Usage:
+ *     selftest
+ */
+
+#include "fpm.h"
+#include "fpm_emu.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEMPLATE_SZ         512
+#define CAPACITY            200
+
+FPM_EMU_PORT(emu)
+
+static FPM finger;
+
+/* a fresh sensor with IDs 0-4 taken, and a fresh handle for it */
+static int setup(void)
+{
+    if (fpm_emu_init(&emu, CAPACITY, TEMPLATE_SZ) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    for (uint16_t id = 0; id < 5; id++)
+        fpm_emu_enroll(&emu, id, 100 + id);
+
+    memset(&finger, 0, sizeof(FPM));
+    FPM_EMU_ATTACH(&finger, emu);
+    finger.address = FPM_DEFAULT_ADDRESS;
+    finger.password = FPM_DEFAULT_PASSWORD;
+
+    if (!fpm_begin(&finger, fpm_emu_millis)) {
+        printf("fpm_begin failed\n");
+        fpm_emu_free(&emu);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* a capture after a run of quick "no finger" replies must not time out */
+static int test_capture_after_no_finger(void)
+{
+    emu.finger = 0;
+    emu.latency.get_image = 5;
+
+    for (int i = 0; i < 20; i++) {
+        if (fpm_get_image(&finger) != FPM_NOFINGER) {
+            printf("no finger: expected FPM_NOFINGER\n");
+            return -1;
+        }
+    }
+
+    emu.finger = 101;
+    emu.latency.get_image = 600;
+
+    int16_t rc = fpm_get_image(&finger);
+    if (rc != FPM_OK) {
+        printf("capture after %d ms timeout: code %d\n", fpm_get_timeout(&finger, FPM_GETIMAGE), rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* one slow conversion, then many quick ones: the next slow one must still get through */
+static int test_slow_after_fast(void)
+{
+    emu.finger = 101;
+    emu.latency.image2tz = 300;
+
+    if (fpm_get_image(&finger) != FPM_OK || fpm_image2Tz(&finger, 1) != FPM_OK) {
+        printf("first conversion failed\n");
+        return -1;
+    }
+
+    emu.latency.image2tz = 10;
+    for (int i = 0; i < 20; i++) {
+        if (fpm_image2Tz(&finger, 1) != FPM_OK) {
+            printf("quick conversion %d failed\n", i);
+            return -1;
+        }
+    }
+
+    emu.latency.image2tz = 300;
+
+    int16_t rc = fpm_image2Tz(&finger, 1);
+    if (rc != FPM_OK) {
+        printf("slow conversion after %d ms timeout: code %d\n", fpm_get_timeout(&finger, FPM_IMAGE2TZ), rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the reply to a command that timed out turns up before the next command is sent */
+static int test_late_reply(void)
+{
+    uint16_t count = 0;
+
+    emu.finger = 101;
+    emu.latency.store = 300;
+    fpm_set_timeout(&finger, FPM_STORE, 50);
+
+    if (fpm_get_image(&finger) != FPM_OK || fpm_image2Tz(&finger, 1) != FPM_OK) {
+        printf("capture failed\n");
+        return -1;
+    }
+
+    if (fpm_store_model(&finger, 10, 1) != FPM_TIMEOUT) {
+        printf("store didn't time out\n");
+        return -1;
+    }
+
+    /* the store's ACK arrives meanwhile */
+    fpm_emu_sleep(400);
+    fpm_set_timeout(&finger, FPM_STORE, 0);
+
+    int16_t rc = fpm_get_template_count(&finger, &count);
+    if (rc != FPM_OK || count != 6) {
+        printf("template count after a late reply: code %d, count %u\n", rc, count);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void on_done(void * ctx, int16_t rc)
+{
+    *(int16_t *)ctx = rc;
+}
+
+/* an async command whose transmission never completes must time out, not poll forever */
+static int test_stuck_transmission(void)
+{
+    int16_t result = FPM_BUSY;
+
+    /* the emulator sends at once and never calls fpm_tx_done() */
+    finger.async_tx = 1;
+    fpm_set_timeout(&finger, FPM_LEDON, 100);
+
+    if (fpm_led_on_async(&finger, on_done, &result) != FPM_OK) {
+        printf("couldn't submit\n");
+        return -1;
+    }
+
+    uint32_t start = fpm_emu_millis();
+    while (fpm_poll(&finger)) {
+        if (fpm_emu_millis() - start > 1000) {
+            printf("still polling after 1 s\n");
+            return -1;
+        }
+        fpm_emu_sleep(0);
+    }
+
+    if (result != FPM_TIMEOUT) {
+        printf("expected FPM_TIMEOUT, got %d\n", result);
+        return -1;
+    }
+
+    /* and the next command isn't stuck behind it */
+    finger.async_tx = 0;
+    if (fpm_led_off(&finger) != FPM_OK) {
+        printf("next command failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the same with the blocking API: the command times out, and the next one doesn't wait forever for the last */
+static int test_stuck_transmission_blocking(void)
+{
+    finger.async_tx = 1;
+    fpm_set_timeout(&finger, FPM_LEDON, 100);
+
+    if (fpm_led_on(&finger) != FPM_TIMEOUT) {
+        printf("expected FPM_TIMEOUT\n");
+        return -1;
+    }
+
+    /* a frame stuck in the transport, as if the ISR never fired */
+    finger.async_tx = 0;
+    finger.tx_busy = 1;
+
+    uint32_t start = fpm_emu_millis();
+    int16_t rc = fpm_led_off(&finger);
+    /* the data timeout bounds the wait, FPM_DEFAULT_TIMEOUT until data packets have been seen */
+    if (rc != FPM_OK || fpm_emu_millis() - start > FPM_DEFAULT_TIMEOUT + 500) {
+        printf("next command: code %d after %lu ms\n", rc, (unsigned long)(fpm_emu_millis() - start));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* runs an async command to the end */
+static int16_t finish(int16_t rc, int16_t * result)
+{
+    if (rc != FPM_OK)
+        return rc;
+
+    while (fpm_poll(&finger))
+        fpm_emu_sleep(0);
+
+    return *result;
+}
+
+/* an async store, then another async command: the stored ID must stay taken in the index cache */
+static int test_index_after_async_store(void)
+{
+    int16_t result = FPM_BUSY;
+    int16_t fid = -1;
+    uint16_t count = 0;
+
+    emu.finger = 200;
+
+    /* loads the first page of the index */
+    if (fpm_get_free_index(&finger, 0, &fid) != FPM_OK || fid != 5) {
+        printf("first free ID: %d\n", fid);
+        return -1;
+    }
+
+    if (fpm_get_image(&finger) != FPM_OK || fpm_image2Tz(&finger, 1) != FPM_OK ||
+            finish(fpm_store_model_async(&finger, 5, 1, on_done, &result), &result) != FPM_OK) {
+        printf("async store failed\n");
+        return -1;
+    }
+
+    if (finish(fpm_led_on_async(&finger, on_done, &result), &result) != FPM_OK) {
+        printf("async LED on failed\n");
+        return -1;
+    }
+
+    if (fpm_get_free_index(&finger, 0, &fid) != FPM_OK || fid != 6 ||
+            fpm_get_template_count(&finger, &count) != FPM_OK || count != 6) {
+        printf("after the store: first free ID %d, %u templates\n", fid, count);
+        return -1;
+    }
+
+    return 0;
+}
+
+static const struct {
+    const char * name;
+    int (*run)(void);
+} tests[] = {
+    { "capture after no finger", test_capture_after_no_finger },
+    { "slow after fast", test_slow_after_fast },
+    { "late reply", test_late_reply },
+    { "stuck transmission", test_stuck_transmission },
+    { "stuck transmission, blocking", test_stuck_transmission_blocking },
+    { "index after async store", test_index_after_async_store },
+};
+
+int main(void)
+{
+    int failed = 0;
+
+    for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if (setup() < 0)
+            return 1;
+
+        int rc = tests[i].run();
+        printf("%-32s %s\n", tests[i].name, rc == 0 ? "ok" : "FAILED");
+        if (rc != 0)
+            failed++;
+
+        fpm_emu_free(&emu);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * stress.c
+ *
+ * Drives many emulated sensors at once, one thread each, to check that
+ * FPM handles don't interfere with each other. Every sensor gets its own
+ * clock, some of them wrapping around during the run.
+ *
+ * Build with:
+ *     gcc -O2 -pthread -I../../src ../../src/fpm.c ../../src/fpm_image.c fpm_emu.c stress.c -o stress
+ *
+ * Usage:
+ *     stress [-n sensors] [-r rounds] [-f]
+ *
+ *     -f  no emulated latency, as fast as the host goes
+ */
+
+#include "fpm.h"
+#include "fpm_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define TEMPLATE_SZ         512
+#define CAPACITY            200
+
+typedef struct {
+    int index;
+    int rounds;
+
+    FPM_Emu emu;
+    FPM fpm;
+    uint32_t clock_offset;
+
+    int failures;
+    uint32_t commands;
+} sensor_t;
+
+/* The transport and clock functions take no context, so each thread points them at its own sensor */
+static _Thread_local sensor_t * current;
+
+static uint16_t sensor_read(uint8_t * bytes, uint16_t len)
+{
+    return fpm_emu_read(&current->emu, bytes, len);
+}
+
+static void sensor_write(uint8_t * bytes, uint16_t len)
+{
+    fpm_emu_write(&current->emu, bytes, len);
+}
+
+static uint16_t sensor_avail(void)
+{
+    return fpm_emu_avail(&current->emu);
+}
+
+/* the other sensors' threads run while this one waits */
+static uint16_t sensor_wait(uint16_t min_bytes, uint16_t timeout)
+{
+    return fpm_emu_wait(&current->emu, min_bytes, timeout);
+}
+
+static void sensor_set_baud(uint32_t baud)
+{
+    current->emu.host_baud = baud;
+}
+
+static uint32_t sensor_millis(void)
+{
+    return fpm_emu_millis() + current->clock_offset;
+}
+
+typedef struct {
+    uint8_t data[TEMPLATE_SZ];
+    uint16_t len;
+} template_t;
+
+static void to_template(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last)
+{
+    template_t * tmpl = (template_t *)ctx;
+    (void)is_last;
+
+    if (len > TEMPLATE_SZ - tmpl->len)
+        len = TEMPLATE_SZ - tmpl->len;
+
+    memcpy(&tmpl->data[tmpl->len], data, len);
+    tmpl->len += len;
+}
+
+static uint16_t from_template(void * ctx, uint8_t * buf, uint16_t len)
+{
+    template_t * tmpl = (template_t *)ctx;
+
+    if (len > TEMPLATE_SZ - tmpl->len)
+        len = TEMPLATE_SZ - tmpl->len;
+
+    memcpy(buf, &tmpl->data[tmpl->len], len);
+    tmpl->len += len;
+    return len;
+}
+
+static void on_done(void * ctx, int16_t rc)
+{
+    *(int16_t *)ctx = rc;
+}
+
+#define CHECK(cond, what) do { \
+        if (!(cond)) { \
+            printf("sensor %d, round %d: %s\n", s->index, round, what); \
+            s->failures++; \
+            return; \
+        } \
+    } while (0)
+
+static void run_round(sensor_t * s, int round)
+{
+    FPM * fpm = &s->fpm;
+    uint16_t own_id = s->index;
+    uint16_t copy_id = CAPACITY - 1 - s->index;
+    uint16_t id, score, count;
+    template_t fetched = { {0}, 0 };
+    template_t copy = { {0}, 0 };
+    FPM_Transfer out, in, back;
+
+    CHECK(fpm_get_image(fpm) == FPM_OK, "getimage");
+    CHECK(fpm_image2Tz(fpm, 1) == FPM_OK, "image2tz");
+    CHECK(fpm_search_database(fpm, &id, &score, 1) == FPM_OK, "search");
+    CHECK(id == own_id, "search found another sensor's finger");
+
+    /* round trip of the template through the host */
+    FPM_Sink sink = { to_template, &fetched };
+    CHECK(fpm_fetch_template(fpm, own_id, &sink, &out) == FPM_OK, "fetch");
+    CHECK(fetched.len == TEMPLATE_SZ, "fetched length");
+
+    FPM_Source source = { from_template, &fetched };
+    fetched.len = 0;
+    CHECK(fpm_push_template(fpm, copy_id, &source, TEMPLATE_SZ, &in) == FPM_OK, "push");
+    CHECK(in.crc == out.crc, "pushed CRC");
+
+    sink.ctx = &copy;
+    CHECK(fpm_fetch_template(fpm, copy_id, &sink, &back) == FPM_OK, "fetch copy");
+    CHECK(back.crc == out.crc, "copy CRC");
+
+    CHECK(fpm_get_template_count(fpm, &count) == FPM_OK && count == 2, "template count");
+
+    /* and the async API, on the same handle */
+    int16_t rc = FPM_BUSY;
+    CHECK(fpm_get_image_async(fpm, on_done, &rc) == FPM_OK, "async submit");
+    while (fpm_poll(fpm))
+        sched_yield();
+    CHECK(rc == FPM_OK, "async getimage");
+}
+
+static void * sensor_thread(void * arg)
+{
+    sensor_t * s = (sensor_t *)arg;
+    FPM * fpm = &s->fpm;
+
+    current = s;
+
+    fpm->address = FPM_DEFAULT_ADDRESS;
+    fpm->password = FPM_DEFAULT_PASSWORD;
+    fpm->read_func = sensor_read;
+    fpm->write_func = sensor_write;
+    fpm->avail_func = sensor_avail;
+    fpm->set_baud_func = sensor_set_baud;
+    fpm->wait_func = sensor_wait;
+    fpm->sleep_func = fpm_emu_sleep;
+    fpm->auto_link = 1;
+
+    if (!fpm_begin(fpm, sensor_millis)) {
+        printf("sensor %d: fpm_begin failed\n", s->index);
+        s->failures++;
+        return NULL;
+    }
+
+    for (int round = 0; round < s->rounds; round++) {
+        run_round(s, round);
+        if (s->failures)
+            break;
+    }
+
+    FPM_Stats stats;
+    fpm_get_stats(fpm, &stats, 0);
+    if (stats.checksum_errors || stats.address_errors || stats.length_errors || stats.timeouts || stats.pid_errors) {
+        printf("sensor %d: transport errors\n", s->index);
+        s->failures++;
+    }
+
+    s->commands = s->emu.commands;
+    return NULL;
+}
+
+int main(int argc, char ** argv)
+{
+    int sensors = 8;
+    int rounds = 3;
+    uint8_t realtime = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:f")) != -1) {
+        switch (opt) {
+            case 'n': sensors = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'f': realtime = 0; break;
+            default:
+                fprintf(stderr, "Usage: stress [-n sensors] [-r rounds] [-f]\n");
+                return 2;
+        }
+    }
+
+    if (sensors < 1 || sensors > CAPACITY / 2) {
+        fprintf(stderr, "1 to %d sensors\n", CAPACITY / 2);
+        return 2;
+    }
+
+    sensor_t * all = calloc(sensors, sizeof(sensor_t));
+    pthread_t * threads = calloc(sensors, sizeof(pthread_t));
+
+    for (int i = 0; i < sensors; i++) {
+        sensor_t * s = &all[i];
+
+        s->index = i;
+        s->rounds = rounds;
+
+        if (fpm_emu_init(&s->emu, CAPACITY, TEMPLATE_SZ) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        /* a different finger on each sensor, enrolled under the sensor's index */
+        s->emu.realtime = realtime;
+        s->emu.finger = 1000 + i;
+        fpm_emu_enroll(&s->emu, i, 1000 + i);
+
+        /* clocks that disagree, every third one wrapping around within a few seconds */
+        s->clock_offset = (i % 3 == 1) ? (uint32_t)0 - fpm_emu_millis() - 1500 * (i + 1) : 7919u * i;
+    }
+
+    for (int i = 0; i < sensors; i++)
+        pthread_create(&threads[i], NULL, sensor_thread, &all[i]);
+
+    int failures = 0;
+    uint32_t commands = 0;
+
+    for (int i = 0; i < sensors; i++) {
+        pthread_join(threads[i], NULL);
+        failures += all[i].failures;
+        commands += all[i].commands;
+        fpm_emu_free(&all[i].emu);
+    }
+
+    printf("%d sensors, %d rounds, %lu commands: %s\n", sensors, rounds, (unsigned long)commands,
+            failures ? "FAILED" : "ok");
+
+    free(all);
+    free(threads);
+    return failures ? 1 : 0;
+}
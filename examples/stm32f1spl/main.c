@@ -6,16 +6,22 @@
 #include "fpm.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <ctype.h>
 
 /* handles for UART comms, using one for debug and the other for the sensor */
 uart_t uart1_dev = {USART1};
 uart_t uart3_dev = {USART3};
 
+/* set to 0 to send packets to the sensor through the interrupt-driven TX ring instead of DMA */
+#define SENSOR_UART_DMA_TX      1
+
 /* prototypes needed for FPM library comms */
 uint16_t uart3_avail(void);
 uint16_t uart3_read(uint8_t * bytes, uint16_t len);
 void uart3_write(uint8_t * bytes, uint16_t len);
+void uart3_tx_done(void);
+void uart3_set_baud(uint32_t baud);
 
 FPM finger;
 FPM_System_Params params;
@@ -58,6 +64,15 @@ int main(void)
 	finger.avail_func = uart3_avail;
 	finger.read_func = uart3_read;
 	finger.write_func = uart3_write;
+	finger.async_tx = SENSOR_UART_DMA_TX;
+
+	/* a full ring holds one byte less than its size */
+	finger.rx_capacity = UART_MAX_RX_SIZE - 1;
+
+	/* set auto_link to 1 to have fpm_begin() raise the baud rate and packet length as far as they go.
+	 * The sensor keeps these settings across resets, so the host must start at the new baud rate next time */
+	finger.set_baud_func = uart3_set_baud;
+	finger.auto_link = 0;
 
 	/* init fpm instance, supply millis function */
 	if (fpm_begin(&finger, millis)) {
@@ -117,6 +132,7 @@ void templates_mainloop(void) {
 
 		/* read the template from its location into the buffer */
 		uint16_t total_read = read_template(fid, template_buffer, BUFF_SZ);
+		printf("Sensor UART bytes dropped so far: %lu\r\n", uart3_dev.rx_overflows);
 		if (!total_read)
 			return;
 	}
@@ -245,49 +261,42 @@ void enroll_finger(int16_t fid) {
 	}
 }
 
-uint16_t read_template(uint16_t fid, uint8_t * buffer, uint16_t buff_sz) {
-    int16_t p = fpm_load_model(&finger, fid, 1);
-    switch (p) {
-        case FPM_OK:
-            printf("Template %d loaded.\r\n", fid);
-            break;
-        default:
-			printf("Error code: 0x%X!\r\n", p);
-			return 0;
-    }
+/* collects the template from fpm_fetch_template() */
+typedef struct {
+    uint8_t * buffer;
+    uint16_t size;
+    uint16_t pos;
+} buffer_sink_t;
 
-    // OK success!
+void to_buffer(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last) {
+    buffer_sink_t * out = (buffer_sink_t *)ctx;
+
+    if (len > out->size - out->pos)
+        len = out->size - out->pos;
 
-    p = fpm_download_model(&finger, 1);
+    memcpy(out->buffer + out->pos, data, len);
+    out->pos += len;
+}
+
+uint16_t read_template(uint16_t fid, uint8_t * buffer, uint16_t buff_sz) {
+    buffer_sink_t out = { buffer, buff_sz, 0 };
+    FPM_Sink sink = { to_buffer, &out };
+    FPM_Transfer summary;
+
+    int16_t p = fpm_fetch_template(&finger, fid, &sink, &summary);
     switch (p) {
         case FPM_OK:
+            printf("Template %d read in %lu ms, CRC-32: 0x%08lX\r\n", fid, summary.elapsed, summary.crc);
             break;
         default:
 			printf("Error code: 0x%X!\r\n", p);
 			return 0;
     }
 
-    uint8_t read_finished;
-    int16_t count = 0;
-    uint16_t readlen = buff_sz;
-    uint16_t pos = 0;
-
-    while (1) {
-        uint8_t ret = fpm_read_raw(&finger, FPM_OUTPUT_TO_BUFFER, buffer + pos, &read_finished, &readlen);
-        if (ret) {
-            count++;
-            pos += readlen;
-            readlen = buff_sz - pos;
-            if (read_finished)
-                break;
-        }
-        else {
-            printf("Error receiving packet %d\r\n", count);
-            return 0;
-        }
-    }
+    if (out.pos < summary.bytes)
+        printf("Buffer too small, only %d of %d bytes kept\r\n", out.pos, summary.bytes);
 
-    uint16_t total_bytes = count * fpm_packet_lengths[params.packet_len];
+    uint16_t total_bytes = out.pos;
 
     /* just for pretty-printing */
     uint16_t num_rows = total_bytes / 16;
@@ -354,6 +363,19 @@ uint16_t uart3_read(uint8_t * bytes, uint16_t len) {
 }
 
 void uart3_write(uint8_t * bytes, uint16_t len) {
+#if (SENSOR_UART_DMA_TX)
+	uart_write_dma(&uart3_dev, bytes, len, uart3_tx_done);
+#else
 	uart_write(&uart3_dev, bytes, len);
+#endif
+}
+
+/* DMA is done with the frame, the library can reuse it now */
+void uart3_tx_done(void) {
+	fpm_tx_done(&finger);
+}
+
+void uart3_set_baud(uint32_t baud) {
+	uart_set_baud(&uart3_dev, baud);
 }
 
@@ -82,6 +82,9 @@ void uart_init(uart_t * port, uint32_t baud){
     port->ever_written = 0;
     port->timeout = UART_DEFAULT_TIMEOUT;
     port->txi_enabled = 0;
+    port->tx_dma_busy = 0;
+    port->tx_done = NULL;
+    port->rx_overflows = 0;
 }
 
 uint16_t uart_write(uart_t * port, const uint8_t * bytes, uint16_t len){
@@ -94,6 +97,10 @@ uint16_t uart_write(uart_t * port, const uint8_t * bytes, uint16_t len){
 }
 
 uint16_t uart_write_byte(uart_t * port, uint8_t c) {
+    // don't cut into a DMA transmission
+    while (port->tx_dma_busy) {
+    }
+    
     port->ever_written = 1;
     // If the buffer and the data register is empty, just write the byte
     // to the data register and be done. This shortcut helps
@@ -168,7 +175,7 @@ void uart_flush(uart_t * port) {
     if (port->ever_written == 0)
         return;
 
-    while (port->txi_enabled == 1 || USART_GetFlagStatus(port->instance, USART_FLAG_TC) == RESET) {
+    while (port->tx_dma_busy || port->txi_enabled == 1 || USART_GetFlagStatus(port->instance, USART_FLAG_TC) == RESET) {
       
     }
     // If we get here, nothing is queued anymore (DRIE is disabled) and
@@ -179,6 +186,97 @@ void uart_set_timeout(uart_t * port, uint16_t tout) {
     port->timeout = tout;
 }
 
+void uart_set_baud(uart_t * port, uint32_t baud) {
+    USART_InitTypeDef uart;
+    
+    uart_flush(port);
+    
+    uart.USART_BaudRate = baud;
+    uart.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+    uart.USART_Mode = USART_Mode_Tx | USART_Mode_Rx;
+    uart.USART_WordLength = USART_WordLength_8b;
+    uart.USART_Parity = USART_Parity_No;
+    uart.USART_StopBits = USART_StopBits_1;
+    
+    // interrupt enables live in CR1/CR3 bits that USART_Init() leaves alone
+    USART_Cmd(port->instance, DISABLE);
+    USART_Init(port->instance, &uart);
+    USART_Cmd(port->instance, ENABLE);
+}
+
+uint16_t uart_write_dma(uart_t * port, const uint8_t * bytes, uint16_t len, uart_tx_done_func done) {
+    DMA_InitTypeDef dma;
+    NVIC_InitTypeDef NVIC_InitStructure;
+    DMA_Channel_TypeDef * channel;
+    
+    if (len == 0)
+        return 0;
+    
+    // USART1_TX is on DMA1 channel 4, USART3_TX on channel 2
+    if (port->instance == USART1) {
+        channel = DMA1_Channel4;
+        NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel4_IRQn;
+    }
+    else {
+        channel = DMA1_Channel2;
+        NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel2_IRQn;
+    }
+    
+    // let the ring buffer and any earlier DMA transfer drain first
+    while (port->tx_dma_busy || port->txi_enabled == 1) {
+    }
+    
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+    
+    DMA_Cmd(channel, DISABLE);
+    DMA_DeInit(channel);
+    
+    dma.DMA_PeripheralBaseAddr = (uint32_t)&port->instance->DR;
+    dma.DMA_MemoryBaseAddr = (uint32_t)bytes;
+    dma.DMA_DIR = DMA_DIR_PeripheralDST;
+    dma.DMA_BufferSize = len;
+    dma.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    dma.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    dma.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    dma.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    dma.DMA_Mode = DMA_Mode_Normal;
+    dma.DMA_Priority = DMA_Priority_Medium;
+    dma.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(channel, &dma);
+    
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0x2;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0x0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+    
+    port->ever_written = 1;
+    port->tx_done = done;
+    port->tx_dma_busy = 1;
+    
+    DMA_ITConfig(channel, DMA_IT_TC, ENABLE);
+    USART_DMACmd(port->instance, USART_DMAReq_Tx, ENABLE);
+    USART_ClearFlag(port->instance, USART_FLAG_TC);
+    DMA_Cmd(channel, ENABLE);
+    
+    return len;
+}
+
+uint8_t uart_tx_busy(uart_t * port) {
+    return port->tx_dma_busy || port->txi_enabled;
+}
+
+static void generic_dma_tx_handler(uart_t * port, DMA_Channel_TypeDef * channel, uint32_t tc_flag) {
+    if (DMA_GetITStatus(tc_flag) != RESET) {
+        DMA_ClearITPendingBit(tc_flag);
+        DMA_Cmd(channel, DISABLE);
+        USART_DMACmd(port->instance, USART_DMAReq_Tx, DISABLE);
+        
+        port->tx_dma_busy = 0;
+        if (port->tx_done != NULL)
+            port->tx_done();
+    }
+}
+
 static void generic_usart_handler(uart_t * port)
 {
     if (USART_GetITStatus(port->instance, USART_IT_RXNE) != RESET)
@@ -194,6 +292,9 @@ static void generic_usart_handler(uart_t * port)
             port->rx_buf[port->rx_head] = c;
             port->rx_head = i;
         }
+        else {
+            port->rx_overflows++;
+        }
         //USART_ClearITPendingBit(port->instance, USART_IT_RXNE);
     }
     
@@ -215,6 +316,7 @@ static void generic_usart_handler(uart_t * port)
         //USART_ClearITPendingBit(port->instance, USART_IT_TXE);
     }
     if (USART_GetITStatus(port->instance, USART_IT_ORE) != RESET) {
+        port->rx_overflows++;
         USART_ReceiveData(port->instance);
         USART_ClearITPendingBit(port->instance, USART_IT_ORE);
     }
@@ -229,3 +331,13 @@ void USART3_IRQHandler(void)
 {
     generic_usart_handler(&uart3_dev);
 }
+
+void DMA1_Channel4_IRQHandler(void)
+{
+    generic_dma_tx_handler(&uart1_dev, DMA1_Channel4, DMA1_IT_TC4);
+}
+
+void DMA1_Channel2_IRQHandler(void)
+{
+    generic_dma_tx_handler(&uart3_dev, DMA1_Channel2, DMA1_IT_TC2);
+}
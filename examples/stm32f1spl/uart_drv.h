@@ -8,22 +8,35 @@ extern "C" {
 #include "stm32f10x_conf.h"
 
 #define UART_MAX_TX_SIZE       256
-#define UART_MAX_RX_SIZE       256
+
+/* room for two frames of the largest packet length (256 + 12 bytes of overhead),
+ * so the next data packet can arrive while the last one is being handled */
+#define UART_MAX_RX_SIZE       (2 * (256 + 12))
 
 #define UART_DEFAULT_TIMEOUT    500
 
+/* called from interrupt context once a DMA transmission is complete */
+typedef void (*uart_tx_done_func)(void);
+
 typedef struct {
     USART_TypeDef * instance;
     volatile uint8_t ever_written;
     volatile uint8_t txi_enabled;
     uint16_t timeout;
     
+    /* set while a DMA transmission is in progress */
+    volatile uint8_t tx_dma_busy;
+    uart_tx_done_func tx_done;
+    
     volatile uint16_t tx_head;
     volatile uint16_t tx_tail;
     
     volatile uint16_t rx_head;
     volatile uint16_t rx_tail;
     
+    /* received bytes dropped because the ring was full or the hardware overran */
+    volatile uint32_t rx_overflows;
+    
     uint8_t tx_buf[UART_MAX_TX_SIZE];
     uint8_t rx_buf[UART_MAX_RX_SIZE];
 } uart_t;
@@ -38,8 +51,18 @@ uint16_t uart_avail(uart_t * huart);
 void uart_flush(uart_t * uart);
 void uart_set_timeout(uart_t * port, uint16_t tout);
 
+/* change the baud rate on the fly, after any pending output has gone out */
+void uart_set_baud(uart_t * port, uint32_t baud);
+
+/* send 'len' bytes straight out of 'bytes' by DMA and return at once.
+ * The buffer must be left alone until 'done' is called, NULL is fine if not needed */
+uint16_t uart_write_dma(uart_t * port, const uint8_t * bytes, uint16_t len, uart_tx_done_func done);
+uint8_t uart_tx_busy(uart_t * port);
+
 void USART1_IRQHandler(void);
 void USART3_IRQHandler(void);
+void DMA1_Channel4_IRQHandler(void);
+void DMA1_Channel2_IRQHandler(void);
 
 #ifdef __cplusplus
 }
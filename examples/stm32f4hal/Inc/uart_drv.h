@@ -18,10 +18,24 @@ extern "C" {
 #include <stdbool.h>
 
 #define UART_MAX_TX_SIZE       256
-#define UART_MAX_RX_SIZE       256
+
+/* room for two frames of the largest packet length (256 + 12 bytes of overhead),
+ * so the next data packet can arrive while the last one is being handled */
+#define UART_MAX_RX_SIZE       (2 * (256 + 12))
 
 #define UART_DEFAULT_TIMEOUT    500
 
+/* uncomment to count the CPU cycles spent in the UART and DMA interrupt handlers */
+//#define UART_MEASURE_ISR_CYCLES
+
+/* called from interrupt context once a DMA transmission is complete */
+typedef void (*uart_tx_done_func)(void);
+
+typedef struct {
+    uint32_t calls;
+    uint32_t cycles;
+} uart_isr_stats_t;
+
 void uart_init(USART_TypeDef * instance, uint32_t baud_rate);
 
 uint16_t uart_write_byte(USART_TypeDef * instance, uint8_t c);
@@ -34,6 +48,31 @@ uint16_t uart_avail(USART_TypeDef * instance);
 void uart_flush(USART_TypeDef * instance);
 void uart_set_timeout(USART_TypeDef * instance, uint16_t timeout);
 
+/* change the baud rate on the fly, after any pending output has gone out */
+void uart_set_baud(USART_TypeDef * instance, uint32_t baud_rate);
+
+/* switch RX from one interrupt per byte to circular DMA,
+ * with the IDLE interrupt marking the end of each burst */
+void uart_enable_dma_rx(USART_TypeDef * instance);
+
+/* zero-copy access to the RX buffer: get the longest contiguous span
+ * of unread bytes, then mark (some of) them as read */
+uint16_t uart_rx_span(USART_TypeDef * instance, const uint8_t ** span);
+void uart_rx_consume(USART_TypeDef * instance, uint16_t len);
+
+/* send 'len' bytes straight out of 'bytes' by DMA and return at once.
+ * The buffer must be left alone until 'done' is called, NULL is fine if not needed.
+ * Waits for any previous transmission, ring-buffered or DMA, to finish first */
+uint16_t uart_write_dma(USART_TypeDef * instance, const uint8_t * bytes, uint16_t len, uart_tx_done_func done);
+bool uart_tx_busy(USART_TypeDef * instance);
+
+/* number of received bytes dropped because the RX buffer was full or the hardware overran.
+ * In DMA mode, the bytes the DMA wrote over before they were read */
+uint32_t uart_rx_overflows(USART_TypeDef * instance);
+
+void uart_get_isr_stats(USART_TypeDef * instance, uart_isr_stats_t * stats);
+void uart_reset_isr_stats(USART_TypeDef * instance);
+
 #ifdef __cplusplus
 }
 #endif
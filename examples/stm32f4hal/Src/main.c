@@ -20,6 +20,7 @@
 #include "main.h"
 
 #include "fpm.h"
+#include "fpm_image.h"
 #include <uart_drv.h>
 
 #include <stdint.h>
@@ -28,6 +29,15 @@
 #include <stdio.h>
 #include <ctype.h>
 
+/* set to 0 to receive from the sensor with one RXNE interrupt per byte instead of circular DMA.
+ * With UART_MEASURE_ISR_CYCLES defined in uart_drv.h, the templates example prints the interrupts
+ * and CPU cycles each read took, to compare the two.
+ * With DMA, the image example also parses the image straight out of the DMA buffer */
+#define SENSOR_UART_DMA_RX      1
+
+/* set to 0 to send packets to the sensor through the interrupt-driven TX ring instead of DMA */
+#define SENSOR_UART_DMA_TX      1
+
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
@@ -36,6 +46,10 @@ static void MX_GPIO_Init(void);
 uint16_t uart3_avail(void);
 uint16_t uart3_read(uint8_t * bytes, uint16_t len);
 void uart3_write(uint8_t * bytes, uint16_t len);
+void uart3_tx_done(void);
+void uart3_set_baud(uint32_t baud);
+uint16_t uart3_wait(uint16_t min_bytes, uint16_t timeout);
+void uart3_sleep(uint16_t ms);
 
 FPM finger;
 FPM_System_Params params;
@@ -51,6 +65,7 @@ void enroll_mainloop(void);
 void templates_mainloop(void);
 void matchprints_mainloop(void);
 void searchdb_mainloop(void);
+void image_mainloop(void);
 
 /**
  * @brief  The application entry point.
@@ -70,6 +85,9 @@ int main(void)
     uart_init(USART1, 57600);
 
     uart_init(USART3, 57600);
+#if (SENSOR_UART_DMA_RX)
+    uart_enable_dma_rx(USART3);
+#endif
 
     /* disable stdout buffering */
     setvbuf(stdout, NULL, _IONBF, 0);
@@ -81,6 +99,19 @@ int main(void)
     finger.avail_func = uart3_avail;
     finger.read_func = uart3_read;
     finger.write_func = uart3_write;
+    finger.async_tx = SENSOR_UART_DMA_TX;
+
+    /* sleep in __WFI while the sensor works, instead of spinning */
+    finger.wait_func = uart3_wait;
+    finger.sleep_func = uart3_sleep;
+
+    /* a full ring holds one byte less than its size */
+    finger.rx_capacity = UART_MAX_RX_SIZE - 1;
+
+    /* set auto_link to 1 to have fpm_begin() raise the baud rate and packet length as far as they go.
+     * The sensor keeps these settings across resets, so the host must start at the new baud rate next time */
+    finger.set_baud_func = uart3_set_baud;
+    finger.auto_link = 0;
 
     /* init fpm instance, supply time-keeping function */
     if (fpm_begin(&finger, HAL_GetTick))
@@ -100,6 +131,7 @@ int main(void)
     searchdb_mainloop();
     //templates_mainloop();
     //matchprints_mainloop();
+    //image_mainloop();
 }
 
 /**
@@ -205,7 +237,109 @@ void templates_mainloop(void)
         }
 
         /* read the template from its location into the buffer */
+        uart_reset_isr_stats(USART3);
         read_template(fid, template_buffer, BUFF_SZ);
+
+#if defined(UART_MEASURE_ISR_CYCLES)
+        /* compare these with SENSOR_UART_DMA_RX set to 0 and 1 */
+        uart_isr_stats_t stats;
+        uart_get_isr_stats(USART3, &stats);
+        printf("Sensor UART interrupts: %lu, CPU cycles: %lu\r\n", stats.calls, stats.cycles);
+#endif
+        printf("Sensor UART bytes dropped so far: %lu\r\n", uart_rx_overflows(USART3));
+    }
+}
+
+/* sends the unpacked pixels on to the PC */
+void to_pc(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last)
+{
+    uart_write(USART1, data, len);
+}
+
+#if (SENSOR_UART_DMA_RX)
+typedef struct {
+    FPM_Sink * sink;
+    uint32_t bytes;
+    uint8_t done;
+} image_fetch_t;
+
+/* only packets that passed the checksum get here, as with fpm_fetch_image() */
+static void image_packet(void * ctx, uint8_t pid, uint8_t * data, uint16_t len)
+{
+    image_fetch_t * fetch = ctx;
+    uint8_t is_last = (pid == FPM_ENDDATAPACKET);
+
+    if (pid != FPM_DATAPACKET && !is_last)
+        return;
+
+    fetch->sink->func(fetch->sink->ctx, data, len, is_last);
+    fetch->bytes += len;
+    fetch->done = is_last;
+}
+
+/* like fpm_fetch_image(), but the data packets are parsed in place with uart_rx_span()
+ * instead of being copied out of the DMA ring by uart3_read() first */
+static int16_t fetch_image(FPM_Sink * sink)
+{
+    static FPM_Parser parser;
+    static uint8_t payload[FPM_MAX_PACKET_LEN];
+    image_fetch_t fetch = { sink, 0, 0 };
+
+    int16_t rc = fpm_down_image(&finger);
+    if (rc != FPM_OK)
+        return rc;
+
+    fpm_parser_init(&parser, finger.address, payload, sizeof(payload), image_packet, &fetch);
+
+    while (!fetch.done) {
+        const uint8_t * span;
+
+        if (uart3_wait(1, fpm_get_timeout(&finger, FPM_TIMEOUT_DATA)) == 0)
+            return FPM_TIMEOUT;
+
+        /* at most 2 spans, if the data wraps around the end of the ring */
+        uint16_t len = uart_rx_span(USART3, &span);
+        fpm_parser_feed(&parser, span, len);
+        uart_rx_consume(USART3, len);
+    }
+
+    /* a packet that failed its checksum was dropped by the parser, so the image came up short */
+    return (fetch.bytes == FPM_IMAGE_PACKED_SZ) ? FPM_OK : FPM_READ_ERROR;
+}
+#else
+static int16_t fetch_image(FPM_Sink * sink)
+{
+    return fpm_fetch_image(&finger, sink, NULL);
+}
+#endif
+
+/* main loop for image example: streams a PGM image to USART1, save the output to a .pgm file on the PC */
+void image_mainloop(void)
+{
+    static FPM_Unpacker unpacker;
+    FPM_Sink out = { to_pc, NULL };
+    FPM_Sink sink;
+    char header[FPM_PGM_HEADER_MAX];
+
+    fpm_unpacker_init(&unpacker, &out, &sink);
+
+    /* every byte from the sensor becomes 2 pixels, so the PC link must be more than twice as fast
+     * or the sensor UART's RX buffer overflows while we wait on USART1 */
+    printf("Switching to 230400 baud, send any character to capture an image...\r\n");
+    HAL_Delay(10);
+    uart_set_baud(USART1, 230400);
+
+    while (1) {
+        /* no text is printed from here on, so as not to corrupt the image */
+        while (uart_read_byte(USART1) != -1);
+        while (uart_avail(USART1) == 0);
+
+        while (fpm_get_image(&finger) != FPM_OK);
+
+        uint16_t len = fpm_pgm_header(header, FPM_IMAGE_WIDTH, FPM_IMAGE_HEIGHT);
+        uart_write(USART1, (uint8_t *)header, len);
+
+        fetch_image(&sink);
     }
 }
 
@@ -408,50 +542,44 @@ void enroll_finger(int16_t fid)
     }
 }
 
-uint16_t read_template(uint16_t fid, uint8_t * buffer, uint16_t buff_sz)
+/* collects the template from fpm_fetch_template() */
+typedef struct {
+    uint8_t * buffer;
+    uint16_t size;
+    uint16_t pos;
+} buffer_sink_t;
+
+void to_buffer(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last)
 {
-    int16_t p = fpm_load_model(&finger, fid, 1);
-    switch (p) {
-        case FPM_OK:
-            printf("Template %d loaded.\r\n", fid);
-            break;
-        default:
-            printf("Error code: 0x%X!\r\n", p);
-            return 0;
-    }
+    buffer_sink_t * out = (buffer_sink_t *)ctx;
 
-    // OK success!
+    if (len > out->size - out->pos)
+        len = out->size - out->pos;
+
+    memcpy(out->buffer + out->pos, data, len);
+    out->pos += len;
+}
+
+uint16_t read_template(uint16_t fid, uint8_t * buffer, uint16_t buff_sz)
+{
+    buffer_sink_t out = { buffer, buff_sz, 0 };
+    FPM_Sink sink = { to_buffer, &out };
+    FPM_Transfer summary;
 
-    p = fpm_download_model(&finger, 1);
+    int16_t p = fpm_fetch_template(&finger, fid, &sink, &summary);
     switch (p) {
         case FPM_OK:
+            printf("Template %d read in %lu ms, CRC-32: 0x%08lX\r\n", fid, summary.elapsed, summary.crc);
             break;
         default:
             printf("Error code: 0x%X!\r\n", p);
             return 0;
     }
 
-    uint8_t read_finished;
-    int16_t count = 0;
-    uint16_t readlen = buff_sz;
-    uint16_t pos = 0;
-
-    while (1) {
-        uint8_t ret = fpm_read_raw(&finger, FPM_OUTPUT_TO_BUFFER, buffer + pos, &read_finished, &readlen);
-        if (ret) {
-            count++;
-            pos += readlen;
-            readlen = buff_sz - pos;
-            if (read_finished)
-                break;
-        }
-        else {
-            printf("Error receiving packet %d\r\n", count);
-            return 0;
-        }
-    }
+    if (out.pos < summary.bytes)
+        printf("Buffer too small, only %d of %d bytes kept\r\n", out.pos, summary.bytes);
 
-    uint16_t total_bytes = count * fpm_packet_lengths[params.packet_len];
+    uint16_t total_bytes = out.pos;
 
     /* just for pretty-printing */
     uint16_t num_rows = total_bytes / 16;
@@ -519,7 +647,40 @@ uint16_t uart3_read(uint8_t * bytes, uint16_t len) {
 }
 
 void uart3_write(uint8_t * bytes, uint16_t len) {
+#if (SENSOR_UART_DMA_TX)
+    uart_write_dma(USART3, bytes, len, uart3_tx_done);
+#else
     uart_write(USART3, bytes, len);
+#endif
+}
+
+/* DMA is done with the frame, the library can reuse it now */
+void uart3_tx_done(void) {
+    fpm_tx_done(&finger);
+}
+
+void uart3_set_baud(uint32_t baud) {
+    uart_set_baud(USART3, baud);
+}
+
+/* the UART (RXNE, or IDLE and half-transfer with DMA) and SysTick interrupts wake the core,
+ * so the deadline is never missed by more than a tick */
+uint16_t uart3_wait(uint16_t min_bytes, uint16_t timeout) {
+    uint32_t start = HAL_GetTick();
+    uint16_t avail;
+
+    while ((avail = uart_avail(USART3)) < min_bytes && HAL_GetTick() - start < timeout)
+        __WFI();
+
+    return avail;
+}
+
+void uart3_sleep(uint16_t ms) {
+    uint32_t start = HAL_GetTick();
+
+    do {
+        __WFI();
+    } while (HAL_GetTick() - start < ms);
 }
 
 /**
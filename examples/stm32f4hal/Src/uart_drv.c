@@ -9,9 +9,23 @@
 
 typedef struct {
     UART_HandleTypeDef huart;
+    DMA_HandleTypeDef hdma_rx;
+    DMA_HandleTypeDef hdma_tx;
 
     uint16_t timeout;
 
+    /* set if RX is done by circular DMA, the head is then derived from the DMA counter
+     * and 'rx_head' is where it was at the last DMA or IDLE interrupt */
+    uint8_t rx_dma;
+
+    /* set while a DMA transmission is in progress */
+    volatile uint8_t tx_dma_busy;
+    uint8_t tx_dma_ready;
+    uart_tx_done_func tx_done;
+
+    uart_isr_stats_t isr_stats;
+    volatile uint32_t rx_overflows;
+
     volatile uint16_t tx_head;
     volatile uint16_t tx_tail;
 
@@ -27,6 +41,10 @@ static uart_t uart3_handle = {.huart.Instance = USART3};
 
 void USART1_IRQHandler(void);
 void USART3_IRQHandler(void);
+void DMA2_Stream2_IRQHandler(void);
+void DMA1_Stream1_IRQHandler(void);
+void DMA2_Stream7_IRQHandler(void);
+void DMA1_Stream3_IRQHandler(void);
 
 extern void Error_Handler(void);
 
@@ -43,6 +61,24 @@ static inline uart_t * uart_get_handle(USART_TypeDef * instance)
     }
 }
 
+#if defined(UART_MEASURE_ISR_CYCLES)
+#define ISR_CYCLES_START()              uint32_t _isr_start = DWT->CYCCNT
+#define ISR_CYCLES_END(handle)          do { (handle)->isr_stats.calls++; \
+                                             (handle)->isr_stats.cycles += DWT->CYCCNT - _isr_start; } while (0)
+#else
+#define ISR_CYCLES_START()
+#define ISR_CYCLES_END(handle)
+#endif
+
+/* in DMA mode, the head is wherever the DMA will write next */
+static inline uint16_t uart_rx_head(uart_t * handle)
+{
+    if (handle->rx_dma)
+        return (uint16_t)(UART_MAX_RX_SIZE - __HAL_DMA_GET_COUNTER(&handle->hdma_rx)) % UART_MAX_RX_SIZE;
+
+    return handle->rx_head;
+}
+
 /**
  * @brief UART peripheral initialization
  * This function configures the hardware resources
@@ -133,6 +169,17 @@ void uart_init(USART_TypeDef * instance, uint32_t baud_rate)
     handle->rx_tail = 0;
 
     handle->timeout = UART_DEFAULT_TIMEOUT;
+    handle->rx_dma = 0;
+    handle->rx_overflows = 0;
+    handle->tx_dma_busy = 0;
+    handle->tx_dma_ready = 0;
+    handle->tx_done = NULL;
+
+#if defined(UART_MEASURE_ISR_CYCLES)
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
 }
 
 uint16_t uart_write(USART_TypeDef * instance, const uint8_t * bytes, uint16_t len)
@@ -152,6 +199,9 @@ uint16_t uart_write_byte(USART_TypeDef * instance, uint8_t c)
 {
     uart_t * handle = uart_get_handle(instance);
 
+    /* don't cut into a DMA transmission */
+    while (handle->tx_dma_busy) {    }
+
     uint16_t curr_head = handle->tx_head;
     uint16_t curr_tail = handle->tx_tail;
 
@@ -183,7 +233,7 @@ int16_t uart_read_byte(USART_TypeDef * instance)
 {
     uart_t * handle = uart_get_handle(instance);
 
-    uint16_t curr_head = handle->rx_head;
+    uint16_t curr_head = uart_rx_head(handle);
     uint16_t curr_tail = handle->rx_tail;
 
     /* if the head isn't ahead of the tail,
@@ -232,7 +282,7 @@ uint16_t uart_read(USART_TypeDef * instance, uint8_t * bytes, uint16_t len)
 uint16_t uart_avail(USART_TypeDef * instance)
 {
     uart_t * handle = uart_get_handle(instance);
-    return ((uint16_t)(UART_MAX_RX_SIZE + handle->rx_head - handle->rx_tail)) % UART_MAX_RX_SIZE;
+    return ((uint16_t)(UART_MAX_RX_SIZE + uart_rx_head(handle) - handle->rx_tail)) % UART_MAX_RX_SIZE;
 }
 
 void uart_flush(USART_TypeDef * instance)
@@ -244,7 +294,7 @@ void uart_flush(USART_TypeDef * instance)
      *
      * Note: TC should be 1 already at Reset, so it's safe to call this function
      * even when no data has ever been sent */
-    while (__HAL_UART_GET_IT_SOURCE(&handle->huart, UART_IT_TXE)
+    while (handle->tx_dma_busy || __HAL_UART_GET_IT_SOURCE(&handle->huart, UART_IT_TXE)
             || __HAL_UART_GET_FLAG(&handle->huart, UART_FLAG_TC) == RESET)
     {
 
@@ -260,10 +310,255 @@ void uart_set_timeout(USART_TypeDef * instance, uint16_t timeout)
     handle->timeout = timeout;
 }
 
+void uart_set_baud(USART_TypeDef * instance, uint32_t baud_rate)
+{
+    uart_t * handle = uart_get_handle(instance);
+
+    uart_flush(instance);
+
+    /* this only rewrites the frame format and BRR,
+     * interrupt enables and DMA requests are left alone */
+    handle->huart.Init.BaudRate = baud_rate;
+    if (HAL_UART_Init(&handle->huart) != HAL_OK)
+    {
+        Error_Handler();
+    }
+}
+
+uint16_t uart_rx_span(USART_TypeDef * instance, const uint8_t ** span)
+{
+    uart_t * handle = uart_get_handle(instance);
+
+    uint16_t curr_head = uart_rx_head(handle);
+    uint16_t curr_tail = handle->rx_tail;
+
+    *span = &handle->rx_buf[curr_tail];
+
+    /* stop at the end of the buffer if the data wraps around */
+    if (curr_head >= curr_tail)
+        return curr_head - curr_tail;
+    else
+        return UART_MAX_RX_SIZE - curr_tail;
+}
+
+void uart_rx_consume(USART_TypeDef * instance, uint16_t len)
+{
+    uart_t * handle = uart_get_handle(instance);
+    handle->rx_tail = (uint16_t)(handle->rx_tail + len) % UART_MAX_RX_SIZE;
+}
+
+uint32_t uart_rx_overflows(USART_TypeDef * instance)
+{
+    uart_t * handle = uart_get_handle(instance);
+    return handle->rx_overflows;
+}
+
+void uart_get_isr_stats(USART_TypeDef * instance, uart_isr_stats_t * stats)
+{
+    uart_t * handle = uart_get_handle(instance);
+
+    __disable_irq();
+    *stats = handle->isr_stats;
+    __enable_irq();
+}
+
+void uart_reset_isr_stats(USART_TypeDef * instance)
+{
+    uart_t * handle = uart_get_handle(instance);
+
+    __disable_irq();
+    handle->isr_stats.calls = 0;
+    handle->isr_stats.cycles = 0;
+    __enable_irq();
+}
+
+/* called on IDLE, half-transfer and transfer-complete events in DMA mode. The DMA can't move more
+ * than half the ring between two of them, so the bytes that came in since the last one are known,
+ * and any that landed on unread ones are counted as dropped. The reader isn't resynced, as the tail is its own */
+static void uart_dma_rx_event(uart_t * handle)
+{
+    uint16_t head = uart_rx_head(handle);
+    uint16_t unread = (uint16_t)(UART_MAX_RX_SIZE + handle->rx_head - handle->rx_tail) % UART_MAX_RX_SIZE;
+    uint16_t fresh = (uint16_t)(UART_MAX_RX_SIZE + head - handle->rx_head) % UART_MAX_RX_SIZE;
+
+    /* a full ring holds one byte less than its size, as in RXNE mode */
+    if (unread + fresh > UART_MAX_RX_SIZE - 1)
+        handle->rx_overflows += unread + fresh - (UART_MAX_RX_SIZE - 1);
+
+    handle->rx_head = head;
+}
+
+static void uart_dma_rx_callback(DMA_HandleTypeDef * hdma)
+{
+    uart_dma_rx_event((uart_t *)hdma->Parent);
+}
+
+void uart_enable_dma_rx(USART_TypeDef * instance)
+{
+    uart_t * handle = uart_get_handle(instance);
+    UART_HandleTypeDef * huart = &(handle->huart);
+    DMA_HandleTypeDef * hdma = &(handle->hdma_rx);
+    IRQn_Type dma_irq;
+
+    if (instance == USART1)
+    {
+        /* USART1_RX: DMA2 Stream 2, Channel 4 */
+        __HAL_RCC_DMA2_CLK_ENABLE();
+        hdma->Instance = DMA2_Stream2;
+        dma_irq = DMA2_Stream2_IRQn;
+    }
+    else
+    {
+        /* USART3_RX: DMA1 Stream 1, Channel 4 */
+        __HAL_RCC_DMA1_CLK_ENABLE();
+        hdma->Instance = DMA1_Stream1;
+        dma_irq = DMA1_Stream1_IRQn;
+    }
+
+    hdma->Init.Channel = DMA_CHANNEL_4;
+    hdma->Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma->Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma->Init.MemInc = DMA_MINC_ENABLE;
+    hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma->Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma->Init.Mode = DMA_CIRCULAR;
+    hdma->Init.Priority = DMA_PRIORITY_HIGH;
+    hdma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(hdma) != HAL_OK)
+    {
+        Error_Handler();
+    }
+
+    /* the data is picked up by uart_read() or uart_rx_span(); the half-transfer, transfer-complete
+     * and IDLE interrupts count overruns, and wake up a CPU waiting in __WFI */
+    hdma->Parent = handle;
+    hdma->XferCpltCallback = uart_dma_rx_callback;
+    hdma->XferHalfCpltCallback = uart_dma_rx_callback;
+
+    HAL_NVIC_SetPriority(dma_irq, 0x3, 0);
+    HAL_NVIC_EnableIRQ(dma_irq);
+
+    /* no more RXNE interrupts from here on */
+    __HAL_UART_DISABLE_IT(huart, UART_IT_RXNE);
+
+    /* anything still unread in the ring is dropped */
+    handle->rx_head = 0;
+    handle->rx_tail = 0;
+
+    if (HAL_DMA_Start_IT(hdma, (uint32_t)&instance->DR, (uint32_t)handle->rx_buf, UART_MAX_RX_SIZE) != HAL_OK)
+    {
+        Error_Handler();
+    }
+
+    handle->rx_dma = 1;
+
+    __HAL_UART_CLEAR_IDLEFLAG(huart);
+    __HAL_UART_ENABLE_IT(huart, UART_IT_IDLE);
+    SET_BIT(instance->CR3, USART_CR3_DMAR);
+}
+
+static void uart_dma_tx_callback(DMA_HandleTypeDef * hdma)
+{
+    uart_t * handle = (uart_t *)hdma->Parent;
+
+    CLEAR_BIT(handle->huart.Instance->CR3, USART_CR3_DMAT);
+    handle->tx_dma_busy = 0;
+
+    if (handle->tx_done != NULL)
+        handle->tx_done();
+}
+
+static void uart_dma_tx_setup(uart_t * handle)
+{
+    USART_TypeDef * instance = handle->huart.Instance;
+    DMA_HandleTypeDef * hdma = &(handle->hdma_tx);
+    IRQn_Type dma_irq;
+
+    if (instance == USART1)
+    {
+        /* USART1_TX: DMA2 Stream 7, Channel 4 */
+        __HAL_RCC_DMA2_CLK_ENABLE();
+        hdma->Instance = DMA2_Stream7;
+        dma_irq = DMA2_Stream7_IRQn;
+    }
+    else
+    {
+        /* USART3_TX: DMA1 Stream 3, Channel 4 */
+        __HAL_RCC_DMA1_CLK_ENABLE();
+        hdma->Instance = DMA1_Stream3;
+        dma_irq = DMA1_Stream3_IRQn;
+    }
+
+    hdma->Init.Channel = DMA_CHANNEL_4;
+    hdma->Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma->Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma->Init.MemInc = DMA_MINC_ENABLE;
+    hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma->Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma->Init.Mode = DMA_NORMAL;
+    hdma->Init.Priority = DMA_PRIORITY_MEDIUM;
+    hdma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(hdma) != HAL_OK)
+    {
+        Error_Handler();
+    }
+
+    hdma->Parent = handle;
+    hdma->XferCpltCallback = uart_dma_tx_callback;
+    hdma->XferHalfCpltCallback = NULL;
+
+    HAL_NVIC_SetPriority(dma_irq, 0x3, 0);
+    HAL_NVIC_EnableIRQ(dma_irq);
+
+    handle->tx_dma_ready = 1;
+}
+
+uint16_t uart_write_dma(USART_TypeDef * instance, const uint8_t * bytes, uint16_t len, uart_tx_done_func done)
+{
+    uart_t * handle = uart_get_handle(instance);
+
+    if (len == 0)
+        return 0;
+
+    if (!handle->tx_dma_ready)
+        uart_dma_tx_setup(handle);
+
+    /* let the ring buffer and any earlier DMA transfer drain first */
+    while (handle->tx_dma_busy || __HAL_UART_GET_IT_SOURCE(&handle->huart, UART_IT_TXE)) {    }
+
+    handle->tx_done = done;
+    handle->tx_dma_busy = 1;
+
+    if (HAL_DMA_Start_IT(&handle->hdma_tx, (uint32_t)bytes, (uint32_t)&instance->DR, len) != HAL_OK)
+    {
+        handle->tx_dma_busy = 0;
+        return 0;
+    }
+
+    SET_BIT(instance->CR3, USART_CR3_DMAT);
+    return len;
+}
+
+bool uart_tx_busy(USART_TypeDef * instance)
+{
+    uart_t * handle = uart_get_handle(instance);
+    return handle->tx_dma_busy || __HAL_UART_GET_IT_SOURCE(&handle->huart, UART_IT_TXE);
+}
+
 static void generic_usart_handler(uart_t * handle)
 {
     USART_TypeDef * instance = handle->huart.Instance;
 
+    ISR_CYCLES_START();
+
+    /* the line went quiet after a burst, in DMA mode */
+    if (__HAL_UART_GET_IT_SOURCE(&handle->huart, UART_IT_IDLE)
+            && __HAL_UART_GET_FLAG(&handle->huart, UART_FLAG_IDLE))
+    {
+        __HAL_UART_CLEAR_IDLEFLAG(&handle->huart);
+        uart_dma_rx_event(handle);
+    }
+
     if (__HAL_UART_GET_IT_SOURCE(&handle->huart, UART_IT_RXNE)
             && __HAL_UART_GET_FLAG(&handle->huart, UART_FLAG_RXNE))
     {
@@ -278,6 +573,9 @@ static void generic_usart_handler(uart_t * handle)
             handle->rx_buf[handle->rx_head] = c;
             handle->rx_head = i;
         }
+        else {
+            handle->rx_overflows++;
+        }
 
         /* in case the flag got set during the read sequence above */
         __HAL_UART_CLEAR_OREFLAG(&handle->huart);
@@ -286,6 +584,7 @@ static void generic_usart_handler(uart_t * handle)
     else if (__HAL_UART_GET_IT_SOURCE(&handle->huart, UART_IT_RXNE)
             && __HAL_UART_GET_FLAG(&handle->huart, UART_FLAG_ORE))
     {
+        handle->rx_overflows++;
         __HAL_UART_CLEAR_OREFLAG(&handle->huart);
     }
 
@@ -302,6 +601,22 @@ static void generic_usart_handler(uart_t * handle)
             __HAL_UART_DISABLE_IT(&handle->huart, UART_IT_TXE);
         }
     }
+
+    ISR_CYCLES_END(handle);
+}
+
+static void generic_dma_rx_handler(uart_t * handle)
+{
+    ISR_CYCLES_START();
+    HAL_DMA_IRQHandler(&handle->hdma_rx);
+    ISR_CYCLES_END(handle);
+}
+
+static void generic_dma_tx_handler(uart_t * handle)
+{
+    ISR_CYCLES_START();
+    HAL_DMA_IRQHandler(&handle->hdma_tx);
+    ISR_CYCLES_END(handle);
 }
 
 void USART1_IRQHandler(void)
@@ -315,3 +630,27 @@ void USART3_IRQHandler(void)
     uart_t * handle = uart_get_handle(USART3);
     generic_usart_handler(handle);
 }
+
+void DMA2_Stream2_IRQHandler(void)
+{
+    uart_t * handle = uart_get_handle(USART1);
+    generic_dma_rx_handler(handle);
+}
+
+void DMA1_Stream1_IRQHandler(void)
+{
+    uart_t * handle = uart_get_handle(USART3);
+    generic_dma_rx_handler(handle);
+}
+
+void DMA2_Stream7_IRQHandler(void)
+{
+    uart_t * handle = uart_get_handle(USART1);
+    generic_dma_tx_handler(handle);
+}
+
+void DMA1_Stream3_IRQHandler(void)
+{
+    uart_t * handle = uart_get_handle(USART3);
+    generic_dma_tx_handler(handle);
+}
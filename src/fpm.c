@@ -21,32 +21,620 @@
         #define FPM_INFO_PRINTLN(...)
     #else
         #define FPM_INFO_PRINT(...)           	printf(__VA_ARGS__)
-        #define FPM_INFO_PRINTLN(...)         	printf(fmt"\n", ##__VA_ARGS__)
+        #define FPM_INFO_PRINTLN(fmt, ...)     	printf(fmt"\n", ##__VA_ARGS__)
     #endif
 
 #endif
 
+#if defined(FPM_ENABLE_TRACE)
+    #define FPM_TRACE(trace, event, arg8, arg16, arg32)     trace_event((trace), (event), (arg8), (arg16), (arg32))
+#else
+    #define FPM_TRACE(...)      do {} while (0)
+#endif
+
+/* for parsers that may not have anywhere to count */
+#define PARSER_COUNT(parser, counter)   do { if ((parser)->stats != NULL) (parser)->stats->counter++; } while (0)
+
 static void write_packet(FPM * fpm, uint8_t packettype, uint8_t * packet, uint16_t len);
-static int16_t get_reply(FPM * fpm, uint8_t * replyBuf, uint16_t buflen, uint8_t * pktid, fpm_uart_write_func out_stream);
+static int16_t get_reply(FPM * fpm, uint8_t * replyBuf, uint16_t buflen, uint8_t * pktid, uint16_t timeout);
+static uint16_t read_for_parser(FPM * fpm, FPM_Parser * parser, uint16_t avail, uint16_t * packets);
 static int16_t read_ack_get_response(FPM * fpm, uint8_t * rc);
+static void update_index(FPM * fpm, uint8_t opcode, uint16_t id, uint16_t how_many);
 
 const uint16_t fpm_packet_lengths[] = {32, 64, 128, 256};
-static fpm_millis_func millis_func;
 
-typedef enum {
-    FPM_STATE_READ_HEADER,
-    FPM_STATE_READ_ADDRESS,
-    FPM_STATE_READ_PID,
-    FPM_STATE_READ_LENGTH,
-    FPM_STATE_READ_CONTENTS,
-    FPM_STATE_READ_CHECKSUM
-} FPM_State;
+#if defined(FPM_ENABLE_TRACE)
+
+/* the slot is marked as being written before it's touched, and gets its new sequence number once it's filled,
+   so fpm_trace_read() can drop an event that was overwritten while it copied it */
+static void trace_event(FPM_Trace * trace, uint8_t event, uint8_t arg8, uint16_t arg16, uint32_t arg32) {
+    if (trace == NULL)
+        return;
+    
+    uint32_t head = trace->head;
+    uint32_t slot = head & (FPM_TRACE_LEN - 1);
+    FPM_Trace_Event * ev = &trace->events[slot];
+    
+    trace->seq[slot] = head;
+    FPM_MEMORY_BARRIER();
+    
+    ev->time = (trace->clock_func != NULL) ? trace->clock_func() : 0;
+    
+    ev->event = event;
+    ev->arg8 = arg8;
+    ev->arg16 = arg16;
+    ev->arg32 = arg32;
+    
+    FPM_MEMORY_BARRIER();
+    trace->seq[slot] = head + 1;
+    FPM_MEMORY_BARRIER();
+    trace->head = head + 1;
+}
+
+#endif
+
+/* commands with their own timeout, in the order of 'fpm->timing' */
+static const uint8_t timed_opcodes[FPM_TIMED_COMMANDS] = {
+    FPM_GETIMAGE, FPM_IMAGE2TZ, FPM_REGMODEL, FPM_STORE, FPM_LOAD, FPM_UPCHAR, FPM_DOWNCHAR,
+    FPM_IMGUPLOAD, FPM_DELETE, FPM_EMPTYDATABASE, FPM_SETSYSPARAM, FPM_READSYSPARAM,
+    FPM_VERIFYPASSWORD, FPM_SEARCH, FPM_HISPEEDSEARCH, FPM_TEMPLATECOUNT, FPM_READTEMPLATEINDEX,
+    FPM_PAIRMATCH, FPM_SETPASSWORD, FPM_STANDBY, FPM_HANDSHAKE, FPM_LEDON, FPM_LEDOFF,
+    FPM_GETIMAGE_NOLIGHT, FPM_GETRANDOM, FPM_TIMEOUT_DATA
+};
+
+
+/* command encoders: these fill 'fpm->buffer' and return the packet length */
+static uint16_t encode_simple(FPM * fpm, uint8_t opcode) {
+    fpm->buffer[0] = opcode;
+    return 1;
+}
+
+static uint16_t encode_slot(FPM * fpm, uint8_t opcode, uint8_t slot) {
+    fpm->buffer[0] = opcode;
+    fpm->buffer[1] = slot;
+    return 2;
+}
+
+static uint16_t encode_id_slot(FPM * fpm, uint8_t opcode, uint16_t id, uint8_t slot) {
+    fpm->buffer[0] = opcode;
+    fpm->buffer[1] = slot;
+    fpm->buffer[2] = id >> 8; fpm->buffer[3] = id & 0xFF;
+    return 4;
+}
+
+static uint16_t encode_delete(FPM * fpm, uint16_t id, uint16_t how_many) {
+    fpm->buffer[0] = FPM_DELETE;
+    fpm->buffer[1] = id >> 8; fpm->buffer[2] = id & 0xFF;
+    fpm->buffer[3] = how_many >> 8; fpm->buffer[4] = how_many & 0xFF;
+    return 5;
+}
+
+static uint16_t encode_search(FPM * fpm, uint8_t slot) {
+    // high speed search of slot #1 starting at page 0 to 'capacity'
+    fpm->buffer[0] = FPM_SEARCH;
+    fpm->buffer[1] = slot;
+    fpm->buffer[2] = 0x00; fpm->buffer[3] = 0x00;
+    fpm->buffer[4] = (uint8_t)(fpm->sys_params.capacity >> 8);
+    fpm->buffer[5] = (uint8_t)(fpm->sys_params.capacity & 0xFF);
+    return 6;
+}
+
+/* reply decoders: these take the length and confirmation code
+ * from read_ack_get_response() and return the command's result */
+static int16_t decode_status(int16_t len, uint8_t confirm_code) {
+    if (len < 0)
+        return len;
+    
+    return confirm_code;
+}
+
+static int16_t decode_search(FPM * fpm, int16_t len, uint8_t confirm_code, uint16_t * finger_id, uint16_t * score) {
+    if (len < 0)
+        return len;
+    
+    if (confirm_code != FPM_OK)
+        return confirm_code;
+    
+    if (len != 4)
+        return FPM_READ_ERROR;
+
+    *finger_id = fpm->buffer[1];
+    *finger_id <<= 8;
+    *finger_id |= fpm->buffer[2];
+
+    *score = fpm->buffer[3];
+    *score <<= 8;
+    *score |= fpm->buffer[4];
+
+    return confirm_code;
+}
+
+static int16_t decode_u16(FPM * fpm, int16_t len, uint8_t confirm_code, uint16_t * value) {
+    if (len < 0)
+        return len;
+    
+    if (confirm_code != FPM_OK)
+        return confirm_code;
+    
+    if (len != 2)
+        return FPM_READ_ERROR;
+    
+    *value = fpm->buffer[1]; 
+    *value <<= 8;
+    *value |= fpm->buffer[2];
+
+    return confirm_code;
+}
+
+/* send the command in 'fpm->buffer' and wait for its ACK */
+static int16_t run_command(FPM * fpm, uint16_t len, uint8_t * confirm_code) {
+    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, len);
+    return read_ack_get_response(fpm, confirm_code);
+}
+
+uint16_t fpm_frame_size(uint8_t packet_len) {
+    if (packet_len > FPM_PLEN_256)
+        return 0;
+    
+    return fpm_packet_lengths[packet_len] + FPM_PKT_OVERHEAD_LEN;
+}
+
+/* lower the packet length until a whole data frame fits in the transport's RX buffer,
+ * otherwise the tail end of every data packet gets dropped */
+static uint8_t fit_packet_len(FPM * fpm) {
+    if (fpm->rx_capacity == 0)
+        return 1;
+    
+    uint8_t plen = fpm->sys_params.packet_len;
+    
+    while (plen > FPM_PLEN_32 && fpm_frame_size(plen) > fpm->rx_capacity)
+        plen--;
+    
+    if (fpm_frame_size(plen) > fpm->rx_capacity) {
+        FPM_ERROR_PRINTLN("[+]RX buffer too small: %d", fpm->rx_capacity);
+        return 0;
+    }
+    
+    if (plen == fpm->sys_params.packet_len)
+        return 1;
+    
+    if (fpm->manual_settings) {
+        FPM_ERROR_PRINTLN("[+]Packet length too big for RX buffer: %d", fpm_packet_lengths[fpm->sys_params.packet_len]);
+        return 0;
+    }
+    
+    FPM_INFO_PRINTLN("[+]Lowering packet length to %d", fpm_packet_lengths[plen]);
+    return fpm_set_param(fpm, FPM_SETPARAM_PACKET_LEN, plen) == FPM_OK;
+}
+
+static FPM_Timing * get_timing(FPM * fpm, uint8_t opcode) {
+    for (uint8_t i = 0; i < FPM_TIMED_COMMANDS; i++) {
+        if (timed_opcodes[i] == opcode)
+            return &fpm->timing[i];
+    }
+    
+    return NULL;
+}
+
+/* search time grows with the size of the database, so its latency is kept per page of templates */
+static uint8_t is_search(uint8_t opcode) {
+    return opcode == FPM_SEARCH || opcode == FPM_HISPEEDSEARCH;
+}
+
+/* how long these take depends on the finger and the database, not just on the module */
+static uint8_t is_outcome_dependent(uint8_t opcode) {
+    return is_search(opcode) || opcode == FPM_GETIMAGE || opcode == FPM_GETIMAGE_NOLIGHT;
+}
+
+static uint16_t search_capacity(FPM * fpm) {
+    return fpm->sys_params.capacity != 0 ? fpm->sys_params.capacity : FPM_TEMPLATES_PER_PAGE;
+}
+
+static uint16_t command_timeout(FPM * fpm, uint8_t opcode) {
+    FPM_Timing * timing = get_timing(fpm, opcode);
+    
+    if (timing == NULL)
+        return FPM_DEFAULT_TIMEOUT;
+    
+    if (timing->fixed != 0)
+        return timing->fixed;
+    
+    if (timing->average == 0)
+        return FPM_DEFAULT_TIMEOUT;
+    
+    uint32_t expected = timing->peak;
+    if (is_search(opcode))
+        expected = expected * search_capacity(fpm) / FPM_TEMPLATES_PER_PAGE;
+    
+    uint32_t timeout = expected * FPM_TIMEOUT_MULTIPLIER + FPM_TIMEOUT_MARGIN;
+    
+    /* a data packet can't come in faster than the wire allows */
+    if (opcode == FPM_TIMEOUT_DATA && fpm->sys_params.baud_rate != 0) {
+        uint32_t wire_ms = (uint32_t)fpm_frame_size(fpm->sys_params.packet_len) * 10 * 1000 
+                           / fpm_baud_rate(fpm->sys_params.baud_rate);
+        if (timeout < wire_ms * FPM_TIMEOUT_MULTIPLIER + FPM_TIMEOUT_MARGIN)
+            timeout = wire_ms * FPM_TIMEOUT_MULTIPLIER + FPM_TIMEOUT_MARGIN;
+    }
+    
+    if (timeout < FPM_MIN_TIMEOUT)
+        timeout = FPM_MIN_TIMEOUT;
+    
+    if (is_outcome_dependent(opcode) && timeout < FPM_MIN_OUTCOME_TIMEOUT)
+        timeout = FPM_MIN_OUTCOME_TIMEOUT;
+    
+    return (timeout > 0xFFFF) ? 0xFFFF : (uint16_t)timeout;
+}
+
+#if defined(FPM_ENABLE_HISTOGRAMS)
+
+static uint8_t histogram_bucket(uint32_t elapsed) {
+    if (elapsed < 2)
+        return (uint8_t)elapsed;
+    
+    if (elapsed > 0xFFFF)
+        elapsed = 0xFFFF;
+    
+    uint8_t octave = 1;
+    while ((elapsed >> (octave + 1)) != 0)
+        octave++;
+    
+    /* the bit below the top one picks the half of the octave */
+    return 2 * octave + ((elapsed >> (octave - 1)) & 1);
+}
+
+#endif
+
+static void saturating_add(uint16_t * count, uint16_t n) {
+    *count = (*count > 0xFFFF - n) ? 0xFFFF : *count + n;
+}
+
+/* fold a new latency sample into the running average, with a weight of 1/8,
+   and into the peak, which only sinks by 1/32 of the way to a faster sample */
+static void record_latency(FPM * fpm, uint8_t opcode, uint32_t elapsed) {
+    FPM_Timing * timing = get_timing(fpm, opcode);
+    
+    if (timing == NULL)
+        return;
+    
+#if defined(FPM_ENABLE_HISTOGRAMS)
+    saturating_add(&fpm->histograms[timing - fpm->timing].counts[histogram_bucket(elapsed)], 1);
+#endif
+    
+    if (is_search(opcode))
+        elapsed = elapsed * FPM_TEMPLATES_PER_PAGE / search_capacity(fpm);
+    
+    if (elapsed == 0)
+        elapsed = 1;
+    else if (elapsed > 0xFFFF)
+        elapsed = 0xFFFF;
+    
+    if (timing->average == 0) {
+        timing->average = elapsed;
+        timing->peak = elapsed;
+        return;
+    }
+    
+    timing->average = (uint16_t)((int32_t)timing->average + ((int32_t)elapsed - timing->average) / 8);
+    
+    if (elapsed > timing->peak)
+        timing->peak = elapsed;
+    else
+        timing->peak -= (timing->peak - elapsed) / 32;
+}
+
+/* back off after a timeout, in case the module really is that slow now */
+static void record_timeout(FPM * fpm, uint8_t opcode) {
+    FPM_Timing * timing = get_timing(fpm, opcode);
+    
+    fpm->stale_input = 1;
+    
+#if defined(FPM_ENABLE_HISTOGRAMS)
+    if (timing != NULL)
+        saturating_add(&fpm->histograms[timing - fpm->timing].timeouts, 1);
+#endif
+    
+    if (timing == NULL || timing->average == 0)
+        return;
+    
+    timing->average = (timing->average > FPM_DEFAULT_TIMEOUT / 2) ? FPM_DEFAULT_TIMEOUT : timing->average * 2;
+    timing->peak = (timing->peak > FPM_DEFAULT_TIMEOUT / 2) ? FPM_DEFAULT_TIMEOUT : timing->peak * 2;
+}
+
+void fpm_set_timeout(FPM * fpm, uint8_t opcode, uint16_t timeout) {
+    FPM_Timing * timing = get_timing(fpm, opcode);
+    
+    if (timing != NULL)
+        timing->fixed = timeout;
+}
+
+uint16_t fpm_get_timeout(FPM * fpm, uint8_t opcode) {
+    return command_timeout(fpm, opcode);
+}
+
+void fpm_get_stats(FPM * fpm, FPM_Stats * stats, uint8_t reset) {
+    memcpy(stats, &fpm->stats, sizeof(FPM_Stats));
+    
+    if (reset)
+        memset(&fpm->stats, 0, sizeof(FPM_Stats));
+}
+
+#if defined(FPM_ENABLE_TRACE)
+
+uint16_t fpm_trace_read(FPM * fpm, FPM_Trace_Event * events, uint16_t max, uint32_t * dropped) {
+    FPM_Trace * trace = &fpm->trace;
+    uint32_t head = trace->head;
+    uint32_t lost = 0;
+    uint16_t n = 0;
+    
+    FPM_MEMORY_BARRIER();
+    
+    /* the writer lapped us */
+    if (head - trace->tail > FPM_TRACE_LEN) {
+        lost = head - trace->tail - FPM_TRACE_LEN;
+        trace->tail = head - FPM_TRACE_LEN;
+    }
+    
+    while (n < max && trace->tail != head) {
+        uint32_t slot = trace->tail & (FPM_TRACE_LEN - 1);
+        uint32_t seq = trace->seq[slot];
+        
+        FPM_MEMORY_BARRIER();
+        events[n] = trace->events[slot];
+        FPM_MEMORY_BARRIER();
+        
+        /* already overwritten, or overwritten while we were copying it */
+        if (seq != trace->tail + 1 || trace->seq[slot] != seq) {
+            lost++;
+        }
+        else {
+            n++;
+        }
+        
+        trace->tail++;
+    }
+    
+    if (dropped != NULL)
+        *dropped = lost;
+    
+    return n;
+}
+
+void fpm_trace_reset(FPM * fpm) {
+    fpm->trace.tail = fpm->trace.head;
+}
+
+#endif
+
+void fpm_trace_pack(const FPM_Trace_Event * event, uint8_t * buf) {
+    buf[0] = event->time >> 24; buf[1] = event->time >> 16;
+    buf[2] = event->time >> 8; buf[3] = event->time;
+    buf[4] = event->event;
+    buf[5] = event->arg8;
+    buf[6] = event->arg16 >> 8; buf[7] = event->arg16;
+    buf[8] = event->arg32 >> 24; buf[9] = event->arg32 >> 16;
+    buf[10] = event->arg32 >> 8; buf[11] = event->arg32;
+}
+
+void fpm_trace_unpack(FPM_Trace_Event * event, const uint8_t * buf) {
+    event->time = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+    event->event = buf[4];
+    event->arg8 = buf[5];
+    event->arg16 = ((uint16_t)buf[6] << 8) | buf[7];
+    event->arg32 = ((uint32_t)buf[8] << 24) | ((uint32_t)buf[9] << 16) | ((uint32_t)buf[10] << 8) | buf[11];
+}
+
+#if defined(FPM_ENABLE_HISTOGRAMS)
+
+uint8_t fpm_get_histogram(FPM * fpm, uint8_t opcode, FPM_Histogram * snapshot, uint8_t reset) {
+    FPM_Timing * timing = get_timing(fpm, opcode);
+    
+    if (timing == NULL)
+        return 0;
+    
+    FPM_Histogram * hist = &fpm->histograms[timing - fpm->timing];
+    memcpy(snapshot, hist, sizeof(FPM_Histogram));
+    
+    if (reset)
+        memset(hist, 0, sizeof(FPM_Histogram));
+    
+    return 1;
+}
+
+void fpm_reset_histograms(FPM * fpm) {
+    memset(fpm->histograms, 0, sizeof(fpm->histograms));
+}
+
+#endif
+
+void fpm_histogram_merge(FPM_Histogram * into, const FPM_Histogram * from) {
+    for (uint8_t i = 0; i < FPM_HISTOGRAM_BUCKETS; i++)
+        saturating_add(&into->counts[i], from->counts[i]);
+    
+    saturating_add(&into->timeouts, from->timeouts);
+}
+
+uint16_t fpm_histogram_bucket_min(uint8_t bucket) {
+    if (bucket < 2)
+        return bucket;
+    
+    uint8_t octave = bucket / 2;
+    return (1U << octave) + (bucket & 1) * (1U << (octave - 1));
+}
+
+uint16_t fpm_histogram_bucket_max(uint8_t bucket) {
+    if (bucket >= FPM_HISTOGRAM_BUCKETS - 1)
+        return 0xFFFF;
+    
+    return fpm_histogram_bucket_min(bucket + 1) - 1;
+}
+
+uint16_t fpm_histogram_percentile(const FPM_Histogram * hist, uint8_t percent) {
+    uint32_t total = 0;
+    
+    for (uint8_t i = 0; i < FPM_HISTOGRAM_BUCKETS; i++)
+        total += hist->counts[i];
+    
+    if (total == 0)
+        return 0;
+    
+    /* the rank of the sample we want, rounded up */
+    uint32_t rank = (total * percent + 99) / 100;
+    if (rank == 0)
+        rank = 1;
+    
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < FPM_HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank)
+            return fpm_histogram_bucket_max(i);
+    }
+    
+    return 0xFFFF;
+}
+
+void fpm_histogram_serialize(const FPM_Histogram * hist, uint8_t * buf) {
+    *buf++ = FPM_HISTOGRAM_BUCKETS;
+    
+    for (uint8_t i = 0; i < FPM_HISTOGRAM_BUCKETS; i++) {
+        *buf++ = hist->counts[i] >> 8;
+        *buf++ = hist->counts[i] & 0xff;
+    }
+    
+    buf[0] = hist->timeouts >> 8;
+    buf[1] = hist->timeouts & 0xff;
+}
+
+int8_t fpm_histogram_deserialize(FPM_Histogram * hist, const uint8_t * buf) {
+    if (*buf++ != FPM_HISTOGRAM_BUCKETS)
+        return -1;
+    
+    for (uint8_t i = 0; i < FPM_HISTOGRAM_BUCKETS; i++, buf += 2)
+        hist->counts[i] = ((uint16_t)buf[0] << 8) | buf[1];
+    
+    hist->timeouts = ((uint16_t)buf[0] << 8) | buf[1];
+    return 0;
+}
+
+uint32_t fpm_baud_rate(uint8_t baud) {
+    return 9600UL * baud;
+}
+
+/* time a few parameter reads to check the link and estimate its throughput in bytes/s, 0 if it failed */
+#define LINK_TEST_ROUNDS        4
+#define LINK_TEST_BYTES         (FPM_PKT_HEADER_LEN + 1 + 2 + FPM_PKT_HEADER_LEN + 17 + 2)
+
+static uint32_t measure_link(FPM * fpm) {
+    uint32_t start = fpm->millis_func();
+    
+    for (uint8_t i = 0; i < LINK_TEST_ROUNDS; i++) {
+        if (fpm_read_params(fpm, NULL) != FPM_OK)
+            return 0;
+    }
+    
+    uint32_t elapsed = fpm->millis_func() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+    
+    return (uint32_t)LINK_TEST_ROUNDS * LINK_TEST_BYTES * 1000 / elapsed;
+}
+
+/* step the packet length and then the baud rate up as far as they go */
+static uint8_t negotiate_link(FPM * fpm) {
+    if (!fpm->auto_link || fpm->manual_settings)
+        return 1;
+    
+    FPM_INFO_PRINTLN("[+]Link at %lu baud, %d-byte packets: %lu bytes/s", 
+                     (unsigned long)fpm_baud_rate(fpm->sys_params.baud_rate),
+                     fpm_packet_lengths[fpm->sys_params.packet_len], (unsigned long)measure_link(fpm));
+    
+    for (uint8_t plen = FPM_PLEN_256; plen > fpm->sys_params.packet_len; plen--) {
+        if (fpm->rx_capacity != 0 && fpm_frame_size(plen) > fpm->rx_capacity)
+            continue;
+        
+        if (fpm_set_param(fpm, FPM_SETPARAM_PACKET_LEN, plen) == FPM_OK && fpm->sys_params.packet_len == plen) {
+            FPM_INFO_PRINTLN("[+]Packet length now %d", fpm_packet_lengths[plen]);
+            break;
+        }
+    }
+    
+    if (fpm->set_baud_func == NULL)
+        return 1;
+    
+    for (uint8_t baud = fpm->sys_params.baud_rate + 1; baud <= FPM_BAUD_115200; baud++) {
+        uint8_t prev = fpm->sys_params.baud_rate;
+        uint32_t throughput = 0;
+        
+        if (fpm_set_param(fpm, FPM_SETPARAM_BAUD_RATE, baud) == FPM_OK)
+            throughput = measure_link(fpm);
+        
+        if (throughput != 0) {
+            FPM_INFO_PRINTLN("[+]Link at %lu baud: %lu bytes/s", (unsigned long)fpm_baud_rate(baud), 
+                             (unsigned long)throughput);
+            continue;
+        }
+        
+        FPM_ERROR_PRINTLN("[+]Link failed at %lu baud, falling back", (unsigned long)fpm_baud_rate(baud));
+        
+        /* the sensor may not have switched at all */
+        fpm->set_baud_func(fpm_baud_rate(prev));
+        if (fpm_read_params(fpm, NULL) == FPM_OK)
+            return 1;
+        
+        /* it did, so try to talk it back down while the link still half works */
+        fpm->set_baud_func(fpm_baud_rate(baud));
+        if (fpm_set_param(fpm, FPM_SETPARAM_BAUD_RATE, prev) == FPM_OK)
+            return 1;
+        
+        return 0;
+    }
+    
+    return 1;
+}
+
+/* sleeps if the host lets us, spins on the clock otherwise */
+static void pause_ms(FPM * fpm, uint16_t ms) {
+    uint32_t start = fpm->millis_func();
+    uint32_t elapsed;
+    
+    while ((elapsed = fpm->millis_func() - start) < ms) {
+        if (fpm->sleep_func != NULL)
+            fpm->sleep_func(ms - elapsed);
+    }
+}
+
+/* for the previous frame to go out, if 'write_func' is still sending it by DMA.
+   Returns 0 if the transport didn't call fpm_tx_done() in time; the frame is given up on then */
+static uint8_t wait_tx_done(FPM * fpm) {
+    uint32_t start = fpm->millis_func();
+    uint16_t timeout = command_timeout(fpm, FPM_TIMEOUT_DATA);
+    
+    while (fpm->tx_busy) {
+        if ((uint32_t)(fpm->millis_func() - start) >= timeout) {
+            FPM_ERROR_PRINTLN("[+]Transmit timeout");
+            fpm->stats.timeouts++;
+            fpm->tx_busy = 0;
+            return 0;
+        }
+        
+        if (fpm->sleep_func != NULL)
+            fpm->sleep_func(0);
+    }
+    
+    return 1;
+}
 
 uint8_t fpm_begin(FPM * fpm, fpm_millis_func _millis_func) {
-    millis_func = _millis_func;
+    fpm->millis_func = _millis_func;
+    
+#if defined(FPM_ENABLE_TRACE)
+    if (fpm->trace.clock_func == NULL)
+        fpm->trace.clock_func = _millis_func;
+#endif
     
-    uint32_t start = millis_func();
-    while (millis_func() - start < 1000);   // 500 ms at least according to datasheet
+    pause_ms(fpm, 1000);   // 500 ms at least according to datasheet
+    
+    /* could be another sensor than last time */
+    fpm_invalidate_index(fpm);
     
     fpm->buffer[0] = FPM_VERIFYPASSWORD;
     fpm->buffer[1] = (fpm->password >> 24) & 0xff; fpm->buffer[2] = (fpm->password >> 16) & 0xff;
@@ -62,6 +650,12 @@ uint8_t fpm_begin(FPM * fpm, fpm_millis_func _millis_func) {
     if (!fpm->manual_settings && fpm_read_params(fpm, NULL) != FPM_OK)
         return 0;
     
+    if (!fit_packet_len(fpm))
+        return 0;
+    
+    if (!negotiate_link(fpm))
+        return 0;
+    
     return 1;
 }
 
@@ -81,124 +675,68 @@ int16_t fpm_set_password(FPM * fpm, uint32_t pwd) {
 }
 
 int16_t fpm_get_image(FPM * fpm) {
-    fpm->buffer[0] = FPM_GETIMAGE;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-    
-    if (rc < 0)
-        return rc;
-    
-    return confirm_code;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_GETIMAGE), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
 // for ZFM60 modules
 int16_t fpm_get_imageNL(FPM * fpm) {
-    fpm->buffer[0] = FPM_GETIMAGE_NOLIGHT;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-    
-    if (rc < 0)
-        return rc;
-    
-    return confirm_code;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_GETIMAGE_NOLIGHT), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
 // for ZFM60 modules
 int16_t fpm_led_on(FPM * fpm) {
-    fpm->buffer[0] = FPM_LEDON;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-    
-    if (rc < 0)
-        return rc;
-    
-    return confirm_code;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_LEDON), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
 // for ZFM60 modules
 int16_t fpm_led_off(FPM * fpm) {
-    fpm->buffer[0] = FPM_LEDOFF;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-    
-    if (rc < 0)
-        return rc;
-    
-    return confirm_code;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_LEDOFF), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
 int16_t fpm_standby(FPM * fpm) {
-    fpm->buffer[0] = FPM_STANDBY;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-    
-    if (rc < 0)
-        return rc;
-    
-    return confirm_code;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_STANDBY), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
 int16_t fpm_image2Tz(FPM * fpm, uint8_t slot) {
-    fpm->buffer[0] = FPM_IMAGE2TZ; 
-    fpm->buffer[1] = slot;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 2);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-    
-    if (rc < 0)
-        return rc;
-    
-    return confirm_code;
+    int16_t len = run_command(fpm, encode_slot(fpm, FPM_IMAGE2TZ, slot), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
 
 int16_t fpm_create_model(FPM * fpm) {
-    fpm->buffer[0] = FPM_REGMODEL;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-    
-    if (rc < 0)
-        return rc;
-    
-    return confirm_code;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_REGMODEL), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
 
 int16_t fpm_store_model(FPM * fpm, uint16_t id, uint8_t slot) {
-    fpm->buffer[0] = FPM_STORE;
-    fpm->buffer[1] = slot;
-    fpm->buffer[2] = id >> 8; fpm->buffer[3] = id & 0xFF;
-    
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 4);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
+    int16_t len = run_command(fpm, encode_id_slot(fpm, FPM_STORE, id, slot), &confirm_code);
+    int16_t rc = decode_status(len, confirm_code);
     
-    if (rc < 0)
-        return rc;
+    if (rc == FPM_OK)
+        update_index(fpm, FPM_STORE, id, 1);
     
-    return confirm_code;
+    return rc;
 }
     
 //read a fingerprint template from flash into Char Buffer 1
 int16_t fpm_load_model(FPM * fpm, uint16_t id, uint8_t slot) {
-    fpm->buffer[0] = FPM_LOAD;
-    fpm->buffer[1] = slot;
-    fpm->buffer[2] = id >> 8; fpm->buffer[3] = id & 0xFF;
-    
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 4);
     uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-    
-    if (rc < 0)
-        return rc;
-    
-    return confirm_code;
+    int16_t len = run_command(fpm, encode_id_slot(fpm, FPM_LOAD, id, slot), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
 
@@ -209,6 +747,7 @@ int16_t fpm_set_param(FPM * fpm, uint8_t param, uint8_t value) {
     
 	fpm->buffer[0] = FPM_SETSYSPARAM;
     fpm->buffer[1] = param; fpm->buffer[2] = value;
+    FPM_TRACE(&fpm->trace, FPM_TRACE_SET_PARAM, param, value, 0);
     
 	write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 3);
     uint8_t confirm_code = 0;
@@ -220,11 +759,19 @@ int16_t fpm_set_param(FPM * fpm, uint8_t param, uint8_t value) {
     if (confirm_code != FPM_OK)
         return confirm_code;
     
+    /* the ACK came at the old baud rate, the sensor has switched by now */
+    if (param == FPM_SETPARAM_BAUD_RATE && fpm->set_baud_func != NULL)
+        fpm->set_baud_func(fpm_baud_rate(value));
+    
     /* gets weird if you dont wait */
-    uint32_t start = millis_func();
-    while (millis_func() - start < 100);
+    pause_ms(fpm, 100);
+    
+    int16_t rc = fpm_read_params(fpm, NULL);
+    
+    /* no way to tell if the host's new baud rate works otherwise */
+    if (param == FPM_SETPARAM_BAUD_RATE && fpm->set_baud_func != NULL)
+        return rc;
     
-    fpm_read_params(fpm, NULL);
     return confirm_code;
 }
 
@@ -293,24 +840,32 @@ int16_t fpm_down_image(FPM * fpm) {
 
 /* extract template/img data from packets and return 1 if successful */
 uint8_t fpm_read_raw(FPM * fpm, uint8_t outType, void * out, uint8_t * read_complete, uint16_t * read_len) {
-    fpm_uart_write_func out_stream;
-    uint8_t * outBuf;
+    uint8_t * data;
+    uint16_t capacity;
     
-    if (outType == FPM_OUTPUT_TO_BUFFER)
-        outBuf = (uint8_t *)out;
-    else if (outType == FPM_OUTPUT_TO_STREAM)
-        out_stream = (fpm_uart_write_func)out;
+    if (outType == FPM_OUTPUT_TO_BUFFER) {
+        data = (uint8_t *)out;
+        capacity = *read_len;
+    }
+    else if (outType == FPM_OUTPUT_TO_STREAM || outType == FPM_OUTPUT_TO_SINK) {
+        /* held in the frame buffer, past the staging area for the framing, until verified */
+        data = fpm->frame + FPM_PKT_HEADER_LEN;
+        capacity = FPM_MAX_PACKET_LEN;
+    }
     else
         return 0;
     
     uint8_t pid;
     int16_t len;
+    uint16_t timeout = command_timeout(fpm, FPM_TIMEOUT_DATA);
+    uint32_t start = fpm->millis_func();
     
-    /* read into a buffer or straight to a serial port */
-    if (outType == FPM_OUTPUT_TO_BUFFER)
-        len = get_reply(fpm, outBuf, *read_len, &pid, NULL);
-    else if (outType == FPM_OUTPUT_TO_STREAM)
-        len = get_reply(fpm, NULL, 0, &pid, out_stream);
+    len = get_reply(fpm, data, capacity, &pid, timeout);
+    
+    if (len >= 0)
+        record_latency(fpm, FPM_TIMEOUT_DATA, fpm->millis_func() - start);
+    else if (len == FPM_TIMEOUT)
+        record_timeout(fpm, FPM_TIMEOUT_DATA);
     
     /* check that the length is > 0 */
     if (len <= 0) {
@@ -321,13 +876,27 @@ uint8_t fpm_read_raw(FPM * fpm, uint8_t outType, void * out, uint8_t * read_comp
     *read_complete = 0;
     
     if (pid == FPM_DATAPACKET || pid == FPM_ENDDATAPACKET) {
-        if (outType == FPM_OUTPUT_TO_BUFFER)
+        uint8_t is_last = (pid == FPM_ENDDATAPACKET);
+        
+        if (outType == FPM_OUTPUT_TO_BUFFER) {
             *read_len = len;
-        if (pid == FPM_ENDDATAPACKET)
+        }
+        else if (outType == FPM_OUTPUT_TO_STREAM) {
+            ((fpm_uart_write_func)out)(data, len);
+        }
+        else {
+            FPM_Sink * sink = (FPM_Sink *)out;
+            sink->func(sink->ctx, data, len, is_last);
+        }
+        
+        if (is_last)
             *read_complete = 1;
         return 1;
     }
     
+    FPM_ERROR_PRINTLN("[+]Wrong PID: 0x%X", pid);
+    fpm->stats.pid_errors++;
+    FPM_TRACE(&fpm->trace, FPM_TRACE_BAD_PID, pid, 0, 0);
     return 0;
 }
 
@@ -343,118 +912,225 @@ void fpm_write_raw(FPM * fpm, uint8_t * data, uint16_t len) {
     write_packet(fpm, FPM_ENDDATAPACKET, &data[written], len);
 }
 
-//transfer a fingerprint template from Char Buffer 1 to host computer
-int16_t fpm_download_model(FPM * fpm, uint8_t slot) {
-    fpm->buffer[0] = FPM_UPCHAR;
-    fpm->buffer[1] = slot;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 2);
-    uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-
-    if (rc < 0)
-        return rc;
-
-    return confirm_code;
+uint32_t fpm_crc32(uint32_t crc, const uint8_t * data, uint16_t len) {
+    crc = ~crc;
+    
+    while (len--) {
+        crc ^= *data++;
+        for (uint8_t bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    
+    return ~crc;
 }
 
-int16_t fpm_upload_model(FPM * fpm, uint8_t slot) {
-    fpm->buffer[0] = FPM_DOWNCHAR;
-    fpm->buffer[1] = slot;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 2);
-    uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
+typedef struct {
+    FPM_Sink * sink;
+    FPM_Transfer * summary;
+} FPM_Fetch;
 
-    if (rc < 0)
-        return rc;
+/* keeps count and passes each packet on */
+static void fetch_sink(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last) {
+    FPM_Fetch * fetch = (FPM_Fetch *)ctx;
+    
+    fetch->summary->bytes += len;
+    fetch->summary->packets++;
+    fetch->summary->crc = fpm_crc32(fetch->summary->crc, data, len);
+    
+    if (fetch->sink != NULL)
+        fetch->sink->func(fetch->sink->ctx, data, len, is_last);
+}
 
-    return confirm_code;
+/* reads data packets into 'sink' till the last one, keeping count in 'summary' */
+static int16_t receive_data(FPM * fpm, FPM_Sink * sink, FPM_Transfer * summary) {
+    FPM_Fetch fetch = { sink, summary };
+    FPM_Sink counter = { fetch_sink, &fetch };
+    uint8_t read_complete = 0;
+    
+    while (!read_complete) {
+        if (!fpm_read_raw(fpm, FPM_OUTPUT_TO_SINK, &counter, &read_complete, NULL)) {
+            FPM_ERROR_PRINTLN("[+]Error receiving packet %d", summary->packets);
+            return FPM_READ_ERROR;
+        }
+    }
+    
+    return FPM_OK;
 }
+
+int16_t fpm_fetch_template(FPM * fpm, uint16_t id, FPM_Sink * sink, FPM_Transfer * summary) {
+    FPM_Transfer local;
     
-int16_t fpm_delete_model(FPM * fpm, uint16_t id, uint16_t how_many) {
-    fpm->buffer[0] = FPM_DELETE;
-    fpm->buffer[1] = id >> 8; fpm->buffer[2] = id & 0xFF;
-    fpm->buffer[3] = how_many >> 8; fpm->buffer[4] = how_many & 0xFF;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 5);
+    if (summary == NULL)
+        summary = &local;
     
-    uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-
-    if (rc < 0)
+    memset(summary, 0, sizeof(FPM_Transfer));
+    
+    uint32_t start = fpm->millis_func();
+    
+    int16_t rc = fpm_load_model(fpm, id, 1);
+    if (rc != FPM_OK)
         return rc;
-
-    return confirm_code;
+    
+    rc = fpm_download_model(fpm, 1);
+    if (rc != FPM_OK)
+        return rc;
+    
+    rc = receive_data(fpm, sink, summary);
+    
+    summary->elapsed = fpm->millis_func() - start;
+    return rc;
 }
 
-int16_t fpm_empty_database(FPM * fpm) {
-    fpm->buffer[0] = FPM_EMPTYDATABASE;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
-    uint8_t confirm_code = 0;
-    int16_t rc = read_ack_get_response(fpm, &confirm_code);
-
-    if (rc < 0)
+int16_t fpm_fetch_image(FPM * fpm, FPM_Sink * sink, FPM_Transfer * summary) {
+    FPM_Transfer local;
+    
+    if (summary == NULL)
+        summary = &local;
+    
+    memset(summary, 0, sizeof(FPM_Transfer));
+    
+    uint32_t start = fpm->millis_func();
+    
+    int16_t rc = fpm_down_image(fpm);
+    if (rc != FPM_OK)
         return rc;
-
-    return confirm_code;
+    
+    rc = receive_data(fpm, sink, summary);
+    
+    summary->elapsed = fpm->millis_func() - start;
+    return rc;
 }
 
-int16_t fpm_search_database(FPM * fpm, uint16_t * finger_id, uint16_t * score, uint8_t slot) {
-    // high speed search of slot #1 starting at page 0 to 'capacity'
-    fpm->buffer[0] = FPM_SEARCH;
-    fpm->buffer[1] = slot;
-    fpm->buffer[2] = 0x00; fpm->buffer[3] = 0x00;
-    fpm->buffer[4] = (uint8_t)(fpm->sys_params.capacity >> 8);
-    fpm->buffer[5] = (uint8_t)(fpm->sys_params.capacity & 0xFF);
+int16_t fpm_push_template(FPM * fpm, uint16_t id, FPM_Source * source, uint16_t len, FPM_Transfer * summary) {
+    FPM_Transfer local;
     
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 6);
-    uint8_t confirm_code = 0;
-    int16_t len = read_ack_get_response(fpm, &confirm_code);
+    if (summary == NULL)
+        summary = &local;
     
-    if (len < 0)
-        return len;
+    memset(summary, 0, sizeof(FPM_Transfer));
     
-    if (confirm_code != FPM_OK)
-        return confirm_code;
-    
-    if (len != 4)
+    /* the sensor would wait for an end packet that never comes */
+    if (len == 0)
         return FPM_READ_ERROR;
+    
+    uint32_t start = fpm->millis_func();
+    
+    int16_t rc = fpm_upload_model(fpm, 1);
+    if (rc != FPM_OK)
+        return rc;
+    
+    uint16_t chunk_sz = fpm_packet_lengths[fpm->sys_params.packet_len];
+    uint8_t * payload = &fpm->frame[FPM_PKT_HEADER_LEN];
+    
+    while (summary->bytes < len) {
+        uint16_t chunk = len - summary->bytes;
+        if (chunk > chunk_sz)
+            chunk = chunk_sz;
+        
+        /* the previous frame may still be going out by DMA */
+        if (!wait_tx_done(fpm))
+            return FPM_TIMEOUT;
+        
+        /* the source may hand over less than asked, e.g. a socket */
+        uint16_t got = 0;
+        while (got < chunk) {
+            uint16_t n = source->func(source->ctx, payload + got, chunk - got);
+            if (n == 0) {
+                FPM_ERROR_PRINTLN("[+]Source ended at %d of %d bytes", summary->bytes + got, len);
+                return FPM_READ_ERROR;
+            }
+            got += n;
+        }
+        
+        summary->crc = fpm_crc32(summary->crc, payload, chunk);
+        summary->bytes += chunk;
+        summary->packets++;
+        
+        /* already in place, write_packet() only adds the framing */
+        write_packet(fpm, (summary->bytes == len) ? FPM_ENDDATAPACKET : FPM_DATAPACKET, payload, chunk);
+    }
+    
+    rc = fpm_store_model(fpm, id, 1);
+    
+    summary->elapsed = fpm->millis_func() - start;
+    return rc;
+}
 
-    *finger_id = fpm->buffer[1];
-    *finger_id <<= 8;
-    *finger_id |= fpm->buffer[2];
-
-    *score = fpm->buffer[3];
-    *score <<= 8;
-    *score |= fpm->buffer[4];
-
-    return confirm_code;
+//transfer a fingerprint template from Char Buffer 1 to host computer
+int16_t fpm_download_model(FPM * fpm, uint8_t slot) {
+    uint8_t confirm_code = 0;
+    int16_t len = run_command(fpm, encode_slot(fpm, FPM_UPCHAR, slot), &confirm_code);
+    return decode_status(len, confirm_code);
 }
 
-int16_t fpm_match_template_pair(FPM * fpm, uint16_t * score) {
-    fpm->buffer[0] = FPM_PAIRMATCH;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
+int16_t fpm_upload_model(FPM * fpm, uint8_t slot) {
     uint8_t confirm_code = 0;
+    int16_t len = run_command(fpm, encode_slot(fpm, FPM_DOWNCHAR, slot), &confirm_code);
+    return decode_status(len, confirm_code);
+}
     
-    int16_t len = read_ack_get_response(fpm, &confirm_code);
+int16_t fpm_delete_model(FPM * fpm, uint16_t id, uint16_t how_many) {
+    uint8_t confirm_code = 0;
+    int16_t len = run_command(fpm, encode_delete(fpm, id, how_many), &confirm_code);
+    int16_t rc = decode_status(len, confirm_code);
     
-    if (len < 0)
-        return len;
+    if (rc == FPM_OK)
+        update_index(fpm, FPM_DELETE, id, how_many);
     
-    if (confirm_code != FPM_OK)
-        return confirm_code;
+    return rc;
+}
+
+int16_t fpm_empty_database(FPM * fpm) {
+    uint8_t confirm_code = 0;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_EMPTYDATABASE), &confirm_code);
+    int16_t rc = decode_status(len, confirm_code);
     
-    if (len != 2)
-        return FPM_READ_ERROR;
+    if (rc == FPM_OK)
+        update_index(fpm, FPM_EMPTYDATABASE, 0, 0);
     
-    *score = fpm->buffer[1]; 
-    *score <<= 8;
-    *score |= fpm->buffer[2];
+    return rc;
+}
 
-    return confirm_code;
+int16_t fpm_search_database(FPM * fpm, uint16_t * finger_id, uint16_t * score, uint8_t slot) {
+    uint8_t confirm_code = 0;
+    int16_t len = run_command(fpm, encode_search(fpm, slot), &confirm_code);
+    return decode_search(fpm, len, confirm_code, finger_id, score);
 }
 
-int16_t fpm_get_template_count(FPM * fpm, uint16_t * template_cnt) {
-    fpm->buffer[0] = FPM_TEMPLATECOUNT;
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 1);
+int16_t fpm_match_template_pair(FPM * fpm, uint16_t * score) {
+    uint8_t confirm_code = 0;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_PAIRMATCH), &confirm_code);
+    return decode_u16(fpm, len, confirm_code, score);
+}
+
+#if defined(FPM_IS_R551_SENSOR)
+    /* all IDs are off by one in the index, bit 0 is never used */
+    #define FPM_INDEX_OFFSET    1
+#else
+    #define FPM_INDEX_OFFSET    0
+#endif
+
+/* pages the index of a database of 'capacity' templates takes */
+static uint16_t index_pages(FPM * fpm) {
+    return (fpm->sys_params.capacity + FPM_INDEX_OFFSET + FPM_TEMPLATES_PER_PAGE - 1) / FPM_TEMPLATES_PER_PAGE;
+}
+
+/* points 'bits' at the occupancy bits of 'page', from the cache if it's there */
+static int16_t read_index_page(FPM * fpm, uint8_t page, const uint8_t ** bits) {
+#if defined(FPM_ENABLE_INDEX_CACHE)
+    FPM_Index_Cache * cache = &fpm->index_cache;
+    uint8_t cached = (page < FPM_INDEX_CACHE_PAGES);
+    
+    if (cached && (cache->loaded & (1u << page))) {
+        *bits = &cache->bits[page * FPM_INDEX_PAGE_SZ];
+        return FPM_OK;
+    }
+#endif
+    
+    fpm->buffer[0] = FPM_READTEMPLATEINDEX; 
+    fpm->buffer[1] = page;
+    
+    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 2);
     uint8_t confirm_code = 0;
     
     int16_t len = read_ack_get_response(fpm, &confirm_code);
@@ -465,52 +1141,174 @@ int16_t fpm_get_template_count(FPM * fpm, uint16_t * template_cnt) {
     if (confirm_code != FPM_OK)
         return confirm_code;
     
-    if (len != 2)
-        return FPM_READ_ERROR;
+    /* whatever a short reply leaves out counts as taken */
+    if (len < FPM_INDEX_PAGE_SZ)
+        memset(&fpm->buffer[1 + len], 0xFF, FPM_INDEX_PAGE_SZ - len);
     
-    *template_cnt = fpm->buffer[1];
-    *template_cnt <<= 8;
-    *template_cnt |= fpm->buffer[2];
+    *bits = &fpm->buffer[1];
+    
+#if defined(FPM_ENABLE_INDEX_CACHE)
+    if (cached) {
+        memcpy(&cache->bits[page * FPM_INDEX_PAGE_SZ], *bits, FPM_INDEX_PAGE_SZ);
+        cache->loaded |= 1u << page;
+        *bits = &cache->bits[page * FPM_INDEX_PAGE_SZ];
+    }
+#endif
+    
+    return FPM_OK;
+}
 
-    return confirm_code;
+/* the first ID on 'page' from 'from' on whose bit is 'used', -1 if none. Neither IDs past the capacity
+   nor the unused bit 0 of the R551 count */
+static int16_t find_in_page(FPM * fpm, uint8_t page, const uint8_t * bits, uint16_t from, uint8_t used) {
+    uint32_t first = (uint32_t)page * FPM_TEMPLATES_PER_PAGE;
+    uint32_t end = (uint32_t)fpm->sys_params.capacity + FPM_INDEX_OFFSET;
+    uint8_t skip = used ? 0x00 : 0xFF;
+    
+    for (uint16_t byte = 0; byte < FPM_INDEX_PAGE_SZ; byte++) {
+        /* nothing to find in this one */
+        if (bits[byte] == skip)
+            continue;
+        
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            uint32_t index = first + byte * 8 + bit;
+            
+            if (index >= end)
+                return -1;
+            
+            if (index < (uint32_t)from + FPM_INDEX_OFFSET)
+                continue;
+            
+            if (((bits[byte] >> bit) & 1) == used)
+                return (int16_t)(index - FPM_INDEX_OFFSET);
+        }
+    }
+    
+    return -1;
 }
 
-int16_t fpm_get_free_index(FPM * fpm, uint8_t page, int16_t * id) {
-    fpm->buffer[0] = FPM_READTEMPLATEINDEX; 
-    fpm->buffer[1] = page;
+void fpm_invalidate_index(FPM * fpm) {
+#if defined(FPM_ENABLE_INDEX_CACHE)
+    fpm->index_cache.loaded = 0;
+#else
+    (void)fpm;
+#endif
+}
+
+#if defined(FPM_ENABLE_INDEX_CACHE)
+
+static uint8_t popcount8(uint8_t b) {
+    b = b - ((b >> 1) & 0x55);
+    b = (b & 0x33) + ((b >> 2) & 0x33);
+    return (b + (b >> 4)) & 0x0F;
+}
+
+/* counts the templates if the whole database is cached, returns 0 otherwise */
+static uint8_t count_cached(FPM * fpm, uint16_t * template_cnt) {
+    FPM_Index_Cache * cache = &fpm->index_cache;
+    uint16_t pages = index_pages(fpm);
+    uint32_t end = (uint32_t)fpm->sys_params.capacity + FPM_INDEX_OFFSET;
+    uint16_t count = 0;
+    
+    if (pages == 0 || pages > FPM_INDEX_CACHE_PAGES)
+        return 0;
+    
+    uint16_t needed = (uint16_t)((1ul << pages) - 1);
+    if ((cache->loaded & needed) != needed)
+        return 0;
+    
+    for (uint32_t byte = 0; byte * 8 < end; byte++) {
+        uint8_t bits = cache->bits[byte];
+        
+        if (byte == 0)
+            bits &= ~((1u << FPM_INDEX_OFFSET) - 1);
+        
+        if (end - byte * 8 < 8)
+            bits &= (1u << (end - byte * 8)) - 1;
+        
+        count += popcount8(bits);
+    }
+    
+    *template_cnt = count;
+    return 1;
+}
+
+#endif
+
+/* keeps the cached index in step with what a successful command did to the database */
+static uint8_t changes_index(uint8_t opcode) {
+    return opcode == FPM_STORE || opcode == FPM_DELETE || opcode == FPM_EMPTYDATABASE;
+}
+
+static void update_index(FPM * fpm, uint8_t opcode, uint16_t id, uint16_t how_many) {
+#if defined(FPM_ENABLE_INDEX_CACHE)
+    FPM_Index_Cache * cache = &fpm->index_cache;
+    
+    if (opcode == FPM_EMPTYDATABASE) {
+        memset(cache->bits, 0, sizeof(cache->bits));
+        cache->loaded = (uint16_t)((1ul << FPM_INDEX_CACHE_PAGES) - 1);
+        return;
+    }
+    
+    for (uint32_t index = (uint32_t)id + FPM_INDEX_OFFSET; how_many > 0; how_many--, index++) {
+        uint32_t page = index / FPM_TEMPLATES_PER_PAGE;
+        
+        /* pages not read yet will be right when they are */
+        if (page >= FPM_INDEX_CACHE_PAGES)
+            break;
+        if (!(cache->loaded & (1u << page)))
+            continue;
+        
+        if (opcode == FPM_STORE)
+            cache->bits[index / 8] |= 1u << (index % 8);
+        else
+            cache->bits[index / 8] &= ~(1u << (index % 8));
+    }
+#else
+    (void)fpm; (void)opcode; (void)id; (void)how_many;
+#endif
+}
+
+int16_t fpm_get_template_count(FPM * fpm, uint16_t * template_cnt) {
+#if defined(FPM_ENABLE_INDEX_CACHE)
+    if (count_cached(fpm, template_cnt))
+        return FPM_OK;
+#endif
     
-    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, 2);
     uint8_t confirm_code = 0;
+    int16_t len = run_command(fpm, encode_simple(fpm, FPM_TEMPLATECOUNT), &confirm_code);
+    return decode_u16(fpm, len, confirm_code, template_cnt);
+}
+
+int16_t fpm_get_free_index(FPM * fpm, uint8_t page, int16_t * id) {
+    const uint8_t * bits;
+    int16_t rc = read_index_page(fpm, page, &bits);
     
-    int16_t len = read_ack_get_response(fpm, &confirm_code);
+    if (rc != FPM_OK)
+        return rc;
     
-    if (len < 0)
-        return len;
+    *id = find_in_page(fpm, page, bits, 0, 0);
+    return FPM_OK;
+}
+
+int16_t fpm_get_used_index(FPM * fpm, uint16_t from, int16_t * id) {
+    uint16_t pages = index_pages(fpm);
     
-    if (confirm_code != FPM_OK)
-        return confirm_code;
+    *id = -1;
     
-    for (int group_idx = 0; group_idx < len; group_idx++) {
-        uint8_t group = fpm->buffer[1 + group_idx];
-        if (group == 0xff)        /* if group is all occupied */
-            continue;
+    for (uint16_t page = (from + FPM_INDEX_OFFSET) / FPM_TEMPLATES_PER_PAGE; page < pages; page++) {
+        const uint8_t * bits;
+        int16_t rc = read_index_page(fpm, page, &bits);
         
-        for (uint8_t bit_mask = 0x01, fid = 0; bit_mask != 0; bit_mask <<= 1, fid++) {
-            if ((bit_mask & group) == 0) {
-                #if defined(FPM_IS_R551_SENSOR)
-                if (page == 0 && group_idx == 0 && fid == 0)     /* Skip LSb of first group */
-                    continue;
-                *id = (FPM_TEMPLATES_PER_PAGE * page) + (group_idx * 8) + fid - 1;      /* all IDs are off by one */
-                #else
-                *id = (FPM_TEMPLATES_PER_PAGE * page) + (group_idx * 8) + fid;
-                #endif
-                return confirm_code;
-            }
-        }
+        if (rc != FPM_OK)
+            return rc;
+        
+        *id = find_in_page(fpm, page, bits, from, 1);
+        if (*id >= 0)
+            break;
     }
     
-    *id = FPM_NOFREEINDEX;  // no free space found
-    return confirm_code;
+    return FPM_OK;
 }
 
 int16_t fpm_get_random_number(FPM * fpm, uint32_t * number) {
@@ -552,170 +1350,688 @@ uint8_t fpm_handshake(FPM * fpm) {
     return confirm_code == FPM_HANDSHAKE_OK;
 }
 
+static void on_command_reply(void * ctx, uint8_t pid, uint8_t * data, uint16_t len) {
+    (void)data;
+    
+    FPM_Command * cmd = (FPM_Command *)ctx;
+    cmd->pid = pid;
+    cmd->len = len;
+    cmd->got_reply = 1;
+}
+
+/* sends the command in 'fpm->buffer' and arms the parser for its ACK */
+static int16_t submit_command(FPM * fpm, uint16_t len, uint16_t * out1, uint16_t * out2,
+                              fpm_done_func done_func, void * ctx) {
+    FPM_Command * cmd = &fpm->pending;
+    
+    cmd->opcode = fpm->buffer[0];
+    cmd->done_func = done_func;
+    cmd->ctx = ctx;
+    cmd->out1 = out1;
+    cmd->out2 = out2;
+    cmd->id = 0;
+    cmd->how_many = 0;
+    cmd->got_reply = 0;
+    fpm_parser_init(&cmd->parser, fpm->address, fpm->buffer, FPM_BUFFER_SZ, on_command_reply, cmd);
+    cmd->parser.stats = &fpm->stats;
+#if defined(FPM_ENABLE_TRACE)
+    cmd->parser.trace = &fpm->trace;
+#endif
+    
+    write_packet(fpm, FPM_COMMANDPACKET, fpm->buffer, len);
+    
+    cmd->last_read = fpm->millis_func();
+    cmd->active = 1;
+    return FPM_OK;
+}
+
+static int16_t finish_command(FPM * fpm) {
+    FPM_Command * cmd = &fpm->pending;
+    
+    if (cmd->pid != FPM_ACKPACKET) {
+        FPM_ERROR_PRINTLN("[+]Wrong PID: 0x%X", cmd->pid);
+        fpm->stats.pid_errors++;
+        FPM_TRACE(&fpm->trace, FPM_TRACE_BAD_PID, cmd->pid, 0, 0);
+        return FPM_READ_ERROR;
+    }
+    
+    if (cmd->len == 0)
+        return FPM_READ_ERROR;
+    
+    uint8_t confirm_code = fpm->buffer[0];
+    int16_t len = cmd->len - 1;
+    
+    switch (cmd->opcode) {
+        case FPM_SEARCH:
+            return decode_search(fpm, len, confirm_code, cmd->out1, cmd->out2);
+        case FPM_PAIRMATCH:
+        case FPM_TEMPLATECOUNT:
+            return decode_u16(fpm, len, confirm_code, cmd->out1);
+        default:
+            return decode_status(len, confirm_code);
+    }
+}
+
+uint8_t fpm_busy(FPM * fpm) {
+    return fpm->pending.active;
+}
+
+uint8_t fpm_poll(FPM * fpm) {
+    FPM_Command * cmd = &fpm->pending;
+    
+    if (!cmd->active)
+        return 0;
+    
+    /* the frame buffer is needed for staging, wait till the command is out.
+       If it never is, the command times out below as if the reply was lost */
+    uint16_t avail = fpm->tx_busy ? 0 : fpm->avail_func();
+    
+    while (avail > 0 && !cmd->got_reply) {
+        uint16_t packets;
+        uint16_t got = read_for_parser(fpm, &cmd->parser, avail, &packets);
+        if (got == 0)
+            break;
+        
+        cmd->last_read = fpm->millis_func();
+        avail -= got;
+    }
+    
+    int16_t rc;
+    
+    if (cmd->got_reply) {
+        record_latency(fpm, cmd->opcode, fpm->millis_func() - fpm->cmd_sent);
+        rc = finish_command(fpm);
+        if (rc == FPM_OK && changes_index(cmd->opcode))
+            update_index(fpm, cmd->opcode, cmd->id, cmd->how_many);
+        FPM_TRACE(&fpm->trace, FPM_TRACE_DONE, cmd->opcode, rc, fpm->millis_func() - fpm->cmd_sent);
+    }
+    else if ((uint32_t)(fpm->millis_func() - cmd->last_read) >= command_timeout(fpm, cmd->opcode)) {
+        FPM_ERROR_PRINTLN("[+]Response timeout\r\n");
+        fpm->stats.timeouts++;
+        FPM_TRACE(&fpm->trace, FPM_TRACE_TIMEOUT, cmd->opcode, command_timeout(fpm, cmd->opcode), 0);
+        record_timeout(fpm, cmd->opcode);
+        rc = FPM_TIMEOUT;
+        
+        /* the driver never called fpm_tx_done(), don't let the next command wait on it forever */
+        fpm->tx_busy = 0;
+    }
+    else {
+        return 1;
+    }
+    
+    /* clear this first, so the callback can submit the next command */
+    cmd->active = 0;
+    
+    if (cmd->done_func != NULL)
+        cmd->done_func(cmd->ctx, rc);
+    
+    return cmd->active;
+}
+
+int16_t fpm_get_image_async(FPM * fpm, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_simple(fpm, FPM_GETIMAGE), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_get_imageNL_async(FPM * fpm, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_simple(fpm, FPM_GETIMAGE_NOLIGHT), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_image2Tz_async(FPM * fpm, uint8_t slot, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_slot(fpm, FPM_IMAGE2TZ, slot), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_create_model_async(FPM * fpm, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_simple(fpm, FPM_REGMODEL), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_store_model_async(FPM * fpm, uint16_t id, uint8_t slot, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    int16_t rc = submit_command(fpm, encode_id_slot(fpm, FPM_STORE, id, slot), NULL, NULL, done_func, ctx);
+    
+    /* for the index cache, once the store is confirmed */
+    fpm->pending.id = id;
+    fpm->pending.how_many = 1;
+    return rc;
+}
+
+int16_t fpm_load_model_async(FPM * fpm, uint16_t id, uint8_t slot, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_id_slot(fpm, FPM_LOAD, id, slot), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_download_model_async(FPM * fpm, uint8_t slot, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_slot(fpm, FPM_UPCHAR, slot), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_upload_model_async(FPM * fpm, uint8_t slot, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_slot(fpm, FPM_DOWNCHAR, slot), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_delete_model_async(FPM * fpm, uint16_t id, uint16_t how_many, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    int16_t rc = submit_command(fpm, encode_delete(fpm, id, how_many), NULL, NULL, done_func, ctx);
+    
+    /* for the index cache, once the delete is confirmed */
+    fpm->pending.id = id;
+    fpm->pending.how_many = how_many;
+    return rc;
+}
+
+int16_t fpm_empty_database_async(FPM * fpm, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_simple(fpm, FPM_EMPTYDATABASE), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_search_database_async(FPM * fpm, uint16_t * finger_id, uint16_t * score, uint8_t slot,
+                                  fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_search(fpm, slot), finger_id, score, done_func, ctx);
+}
+
+int16_t fpm_match_template_pair_async(FPM * fpm, uint16_t * score, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_simple(fpm, FPM_PAIRMATCH), score, NULL, done_func, ctx);
+}
+
+int16_t fpm_get_template_count_async(FPM * fpm, uint16_t * template_cnt, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_simple(fpm, FPM_TEMPLATECOUNT), template_cnt, NULL, done_func, ctx);
+}
+
+int16_t fpm_led_on_async(FPM * fpm, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_simple(fpm, FPM_LEDON), NULL, NULL, done_func, ctx);
+}
+
+int16_t fpm_led_off_async(FPM * fpm, fpm_done_func done_func, void * ctx) {
+    if (fpm_busy(fpm))
+        return FPM_BUSY;
+    
+    return submit_command(fpm, encode_simple(fpm, FPM_LEDOFF), NULL, NULL, done_func, ctx);
+}
+
+void fpm_tx_done(FPM * fpm) {
+    fpm->tx_busy = 0;
+}
+
+/* after a timeout, anything waiting before the next command goes out is most likely the reply
+   that came in too late. Left there, it would be taken for the new command's reply */
+static void discard_stale_input(FPM * fpm) {
+    uint16_t avail;
+    
+    fpm->stale_input = 0;
+    
+    while ((avail = fpm->avail_func()) > 0) {
+        if (avail > FPM_FRAME_SZ)
+            avail = FPM_FRAME_SZ;
+        
+        uint16_t got = fpm->read_func(fpm->frame, avail);
+        if (got == 0)
+            break;
+        
+        fpm->stats.stale_bytes += got;
+    }
+}
+
 static void write_packet(FPM * fpm, uint8_t packettype, uint8_t * packet, uint16_t len) {
-    len += 2;
-    
-    uint8_t preamble[] = {(uint8_t)(FPM_STARTCODE >> 8), (uint8_t)FPM_STARTCODE,
-                          (uint8_t)(fpm->address >> 24), (uint8_t)(fpm->address >> 16),
-                          (uint8_t)(fpm->address >> 8), (uint8_t)(fpm->address),
-                          (uint8_t)packettype, (uint8_t)(len >> 8), (uint8_t)(len) };
-    
-    fpm->write_func(preamble, sizeof(preamble));
-  
-    uint16_t sum = (len >> 8) + (len & 0xFF) + packettype;
-    for (uint8_t i = 0; i < len - 2; i++) {
-        fpm->write_func(&packet[i], 1);
+    uint8_t * frame = fpm->frame;
+    
+    /* the previous frame may still be going out by DMA. If it's stuck, send this one anyway:
+       a transport that lost the last frame may still manage this one */
+    wait_tx_done(fpm);
+    
+    /* 'frame' is free now, and commands are always staged in 'fpm->buffer' */
+    if (packettype == FPM_COMMANDPACKET && fpm->stale_input)
+        discard_stale_input(fpm);
+    
+    uint8_t * payload = &frame[FPM_PKT_HEADER_LEN];
+    
+    /* length field includes the checksum */
+    uint16_t wire_len = len + 2;
+    
+    frame[0] = (uint8_t)(FPM_STARTCODE >> 8); frame[1] = (uint8_t)FPM_STARTCODE;
+    frame[2] = (uint8_t)(fpm->address >> 24); frame[3] = (uint8_t)(fpm->address >> 16);
+    frame[4] = (uint8_t)(fpm->address >> 8); frame[5] = (uint8_t)(fpm->address);
+    frame[6] = packettype;
+    frame[7] = (uint8_t)(wire_len >> 8); frame[8] = (uint8_t)(wire_len);
+    
+    /* copy the payload and sum it in the same pass, 'packet' may already be 'payload' */
+    uint16_t sum = (wire_len >> 8) + (wire_len & 0xFF) + packettype;
+    for (uint16_t i = 0; i < len; i++) {
+        payload[i] = packet[i];
         sum += packet[i];
     }
     
-    /* assume little-endian mcu */
-    fpm->write_func((uint8_t *)(&sum) + 1, 1);
-    fpm->write_func((uint8_t *)&sum, 1);
+    payload[len] = (uint8_t)(sum >> 8);
+    payload[len + 1] = (uint8_t)(sum);
+    
+    /* mark it busy first, the transfer could be done before 'write_func' even returns */
+    if (fpm->async_tx)
+        fpm->tx_busy = 1;
+    
+    /* header + payload + checksum, all in one call */
+    fpm->write_func(frame, FPM_PKT_HEADER_LEN + wire_len);
+    fpm->stats.tx_bytes += FPM_PKT_HEADER_LEN + wire_len;
+    fpm->stats.tx_packets++;
+    
+    if (packettype == FPM_COMMANDPACKET)
+        FPM_TRACE(&fpm->trace, FPM_TRACE_COMMAND, packet[0], len, 0);
+    else
+        FPM_TRACE(&fpm->trace, FPM_TRACE_DATA_TX, packettype, len, 0);
+    
+    /* the reply's latency is measured from here */
+    if (packettype == FPM_COMMANDPACKET) {
+        fpm->cmd_opcode = packet[0];
+        fpm->cmd_sent = fpm->millis_func();
+    }
+}
+
+void fpm_parser_init(FPM_Parser * parser, uint32_t address, uint8_t * buf, uint16_t buflen,
+                     fpm_packet_func packet_func, void * ctx) {
+    parser->address = address;
+    parser->buf = buf;
+    parser->buflen = buflen;
+    parser->stream = NULL;
+    parser->packet_func = packet_func;
+    parser->ctx = ctx;
+    parser->stats = NULL;
+#if defined(FPM_ENABLE_TRACE)
+    parser->trace = NULL;
+#endif
+    
+    fpm_parser_reset(parser);
 }
 
-static int16_t get_reply(FPM * fpm, uint8_t * replyBuf, uint16_t buflen, 
-                        uint8_t * pktid, fpm_uart_write_func out_stream) {
-                            
-    FPM_State state = FPM_STATE_READ_HEADER;
+void fpm_parser_reset(FPM_Parser * parser) {
+    parser->state = FPM_STATE_READ_HEADER;
+    parser->header = 0;
+    parser->field_pos = 0;
+    parser->pid = 0;
+    parser->length = 0;
+    parser->chksum = 0;
+    parser->pos = 0;
+    parser->lookback_len = 0;
+}
+
+uint16_t fpm_parser_wanted(FPM_Parser * parser) {
+    switch (parser->state) {
+        case FPM_STATE_READ_HEADER:
+            /* no packet is shorter than a header, so this much is safe to take whatever it holds */
+            return ((parser->header & 0xFF) == (FPM_STARTCODE >> 8)) ? FPM_PKT_HEADER_LEN - 1 : FPM_PKT_HEADER_LEN;
+        case FPM_STATE_READ_ADDRESS:
+            return 4 - parser->field_pos;
+        case FPM_STATE_READ_PID:
+            return 1;
+        case FPM_STATE_READ_LENGTH:
+            return 2 - parser->field_pos;
+        case FPM_STATE_READ_CONTENTS:
+            /* the checksum is sure to follow, so ask for it too */
+            return parser->length - parser->pos;
+        case FPM_STATE_READ_CHECKSUM:
+            return 2 - parser->field_pos;
+        default:
+            return 1;
+    }
+}
+
+static void remember(FPM_Parser * parser, const uint8_t * bytes, uint16_t len) {
+    if (len >= FPM_RESYNC_WINDOW) {
+        memcpy(parser->lookback, bytes + len - FPM_RESYNC_WINDOW, FPM_RESYNC_WINDOW);
+        parser->lookback_len = FPM_RESYNC_WINDOW;
+        return;
+    }
     
-    uint16_t header = 0;
-    uint8_t pid = 0;
-    uint16_t length = 0;
-    uint16_t chksum = 0;
-    uint16_t remn = 0;
+    uint16_t keep = parser->lookback_len;
     
-    uint32_t last_read = millis_func();
+    /* drop the oldest bytes to make room */
+    if (keep + len > FPM_RESYNC_WINDOW) {
+        uint16_t drop = keep + len - FPM_RESYNC_WINDOW;
+        memmove(parser->lookback, parser->lookback + drop, keep - drop);
+        keep -= drop;
+    }
     
-    while ((uint32_t)(millis_func() - last_read) < FPM_DEFAULT_TIMEOUT) {        
-        switch (state) {
+    memcpy(parser->lookback + keep, bytes, len);
+    parser->lookback_len = keep + len;
+}
+
+/* parses until 'len' bytes are consumed or a packet turns out bad, 
+ * in which case '*failed' is set and the bytes consumed so far are returned */
+static uint16_t parse_span(FPM_Parser * parser, const uint8_t * bytes, uint16_t len, 
+                           uint16_t * packets, uint8_t * failed) {
+    const uint8_t * start = bytes;
+    
+    *failed = 0;
+    
+    while (len > 0) {
+        /* everything after the start code is kept for a possible resync */
+        if (parser->state != FPM_STATE_READ_HEADER && parser->state != FPM_STATE_READ_CONTENTS)
+            remember(parser, bytes, 1);
+        
+        switch (parser->state) {
             case FPM_STATE_READ_HEADER: {
-                if (fpm->avail_func() == 0)
-                    continue;
+                /* skip straight to the next candidate for the start code */
+                if ((parser->header & 0xFF) != (FPM_STARTCODE >> 8)) {
+                    const uint8_t * hit = memchr(bytes, FPM_STARTCODE >> 8, len);
+                    
+                    if (hit == NULL) {
+                        bytes += len;
+                        len = 0;
+                        parser->header = 0;
+                        break;
+                    }
+                    
+                    len -= hit - bytes;
+                    bytes = hit;
+                }
                 
-                last_read = millis_func();
-                uint8_t byte;
-                fpm->read_func(&byte, 1);
+                parser->header <<= 8; parser->header |= *bytes++;
+                len--;
                 
-                header <<= 8; header |= byte;
-                if (header != FPM_STARTCODE)
+                if (parser->header != FPM_STARTCODE)
                     break;
                 
-                state = FPM_STATE_READ_ADDRESS;
-                header = 0;
+                parser->state = FPM_STATE_READ_ADDRESS;
+                parser->header = 0;
+                parser->field_pos = 0;
+                parser->lookback_len = 0;
                 
                 FPM_INFO_PRINTLN("\r\n[+]Got header");
+                FPM_TRACE(parser->trace, FPM_TRACE_START_CODE, 0, 0, 0);
                 break;
             }
             case FPM_STATE_READ_ADDRESS: {
-                if (fpm->avail_func() < 4)
-                    continue;
-                
-                last_read = millis_func();
-                fpm->read_func(fpm->buffer, 4);
-                uint32_t addr = fpm->buffer[0]; addr <<= 8; 
-                addr |= fpm->buffer[1]; addr <<= 8;
-                addr |= fpm->buffer[2]; addr <<= 8;
-                addr |= fpm->buffer[3];
+                parser->field[parser->field_pos++] = *bytes++;
+                len--;
                 
-                if (addr != fpm->address) {
-                    state = FPM_STATE_READ_HEADER;
-                    FPM_ERROR_PRINTLN("[+]Wrong address: 0x%lX", addr);
+                if (parser->field_pos < 4)
                     break;
-                }
                 
-                state = FPM_STATE_READ_PID;
-                FPM_INFO_PRINTLN("[+]Address: 0x%lX", addr);
+                uint32_t addr = parser->field[0]; addr <<= 8; 
+                addr |= parser->field[1]; addr <<= 8;
+                addr |= parser->field[2]; addr <<= 8;
+                addr |= parser->field[3];
+                
+                if (addr != parser->address) {
+                    FPM_ERROR_PRINTLN("[+]Wrong address: 0x%lX", (unsigned long)addr);
+                    PARSER_COUNT(parser, address_errors);
+                    FPM_TRACE(parser->trace, FPM_TRACE_BAD_ADDRESS, 0, 0, addr);
+                    *failed = 1;
+                    return bytes - start;
+                }
                 
+                parser->state = FPM_STATE_READ_PID;
+                FPM_INFO_PRINTLN("[+]Address: 0x%lX", (unsigned long)addr);
                 break;
             }
             case FPM_STATE_READ_PID:
-                if (fpm->avail_func() == 0)
-                    continue;
-                
-                last_read = millis_func();
-                fpm->read_func(&pid, 1);
-                chksum = pid;
-                *pktid = pid;
-                
-                state = FPM_STATE_READ_LENGTH;
-                FPM_INFO_PRINTLN("[+]PID: 0x%X", pid);
+                parser->pid = *bytes++;
+                len--;
                 
+                parser->chksum = parser->pid;
+                parser->field_pos = 0;
+                parser->state = FPM_STATE_READ_LENGTH;
+                FPM_INFO_PRINTLN("[+]PID: 0x%X", parser->pid);
                 break;
             case FPM_STATE_READ_LENGTH: {
-                if (fpm->avail_func() < 2)
-                    continue;
+                parser->field[parser->field_pos++] = *bytes++;
+                len--;
+                
+                if (parser->field_pos < 2)
+                    break;
                 
-                last_read = millis_func();
-                fpm->read_func(fpm->buffer, 2);
-                length = fpm->buffer[0]; length <<= 8;
-                length |= fpm->buffer[1];
+                uint16_t length = parser->field[0]; length <<= 8;
+                length |= parser->field[1];
                 
-                if (length > FPM_MAX_PACKET_LEN + 2 || (out_stream == NULL && length > buflen + 2)) {
-                    state = FPM_STATE_READ_HEADER;
+                /* length always includes the checksum */
+                if (length < 2 || length > FPM_MAX_PACKET_LEN + 2 || 
+                    (parser->buf != NULL && length > parser->buflen + 2)) {
                     FPM_ERROR_PRINTLN("[+]Packet too long: %d", length);
-                    continue;
+                    PARSER_COUNT(parser, length_errors);
+                    FPM_TRACE(parser->trace, FPM_TRACE_BAD_LENGTH, 0, length, 0);
+                    *failed = 1;
+                    return bytes - start;
                 }
                 
-                /* num of bytes left to read */
-                remn = length;
-                
-                chksum += fpm->buffer[0]; chksum += fpm->buffer[1];
-                state = FPM_STATE_READ_CONTENTS;
+                parser->length = length;
+                parser->pos = 0;
+                parser->chksum += parser->field[0]; parser->chksum += parser->field[1];
+                parser->field_pos = 0;
+                parser->state = (length > 2) ? FPM_STATE_READ_CONTENTS : FPM_STATE_READ_CHECKSUM;
                 FPM_INFO_PRINTLN("[+]Length: %d", length - 2);
                 break;
             }
             case FPM_STATE_READ_CONTENTS: {
-                if (remn <= 2) {
-                    state = FPM_STATE_READ_CHECKSUM;
-                    break;
-                }
+                uint16_t chunk = (parser->length - 2) - parser->pos;
+                if (len < chunk)
+                    chunk = len;
                 
-                if (fpm->avail_func() == 0)
-                    continue;
+                uint16_t sum = parser->chksum;
+                for (uint16_t i = 0; i < chunk; i++)
+                    sum += bytes[i];
+                parser->chksum = sum;
                 
-                last_read = millis_func();
+                remember(parser, bytes, chunk);
                 
-                /* we now have to stop using 'fpm->buffer' since
-                 * we may be storing data in it now */
-                uint8_t byte;
-                fpm->read_func(&byte, 1);
-                if (out_stream != NULL) {
-                    out_stream(&byte, 1);
+                if (parser->buf != NULL) {
+                    /* nothing to copy if it was read in place */
+                    if (bytes != &parser->buf[parser->pos])
+                        memcpy(&parser->buf[parser->pos], bytes, chunk);
                 }
-                else {
-                    *replyBuf++ = byte;
+                else if (parser->stream != NULL) {
+                    parser->stream((uint8_t *)bytes, chunk);
                 }
                 
-                chksum += byte;
+                bytes += chunk;
+                len -= chunk;
+                parser->pos += chunk;
                 
-                FPM_INFO_PRINT("%lX ");
-                remn--;
+                if (parser->pos == parser->length - 2) {
+                    parser->field_pos = 0;
+                    parser->state = FPM_STATE_READ_CHECKSUM;
+                }
                 break;
             }
             case FPM_STATE_READ_CHECKSUM: {
-                if (fpm->avail_func() < 2)
-                    continue;
+                parser->field[parser->field_pos++] = *bytes++;
+                len--;
+                
+                if (parser->field_pos < 2)
+                    break;
                 
-                last_read = millis_func();
-                uint8_t temp[2];
-                fpm->read_func(temp, 2);
-                uint16_t to_check = temp[0]; to_check <<= 8;
-                to_check |= temp[1];
+                uint16_t to_check = parser->field[0]; to_check <<= 8;
+                to_check |= parser->field[1];
                 
-                if (to_check != chksum) {
-                    state = FPM_STATE_READ_HEADER;
+                if (to_check != parser->chksum) {
                     FPM_ERROR_PRINTLN("\r\n[+]Wrong chksum: 0x%X", to_check);
-                    continue;
+                    PARSER_COUNT(parser, checksum_errors);
+                    FPM_TRACE(parser->trace, FPM_TRACE_BAD_CHECKSUM, 0, to_check, parser->chksum);
+                    *failed = 1;
+                    return bytes - start;
                 }
                 
                 FPM_INFO_PRINTLN("\r\n[+]Read complete");
-                /* without chksum */
-                return length - 2;
+                
+                uint8_t pid = parser->pid;
+                uint16_t length = parser->length - 2;
+                fpm_parser_reset(parser);
+                (*packets)++;
+                PARSER_COUNT(parser, rx_packets);
+                FPM_TRACE(parser->trace, FPM_TRACE_PACKET, pid, length, 0);
+                
+                if (parser->packet_func != NULL)
+                    parser->packet_func(parser->ctx, pid, parser->buf, length);
+                break;
             }
         }
     }
     
+    return bytes - start;
+}
+
+/* the packet since the last start code was bad: rescan what's left of it for another start code.
+ * Whatever the window holds is contiguous with the bytes not yet fed */
+static void resync(FPM_Parser * parser, uint16_t * packets) {
+    uint8_t replay[FPM_RESYNC_WINDOW];
+    uint16_t n = parser->lookback_len;
+    uint16_t off = 0;
+    uint8_t failed;
+    
+    memcpy(replay, parser->lookback, n);
+    fpm_parser_reset(parser);
+    
+    while (off < n) {
+        uint16_t used = parse_span(parser, &replay[off], n - off, packets, &failed);
+        
+        if (!failed)
+            break;
+        
+        /* bad again, so start over just after this latest start code */
+        off += used - parser->lookback_len;
+        fpm_parser_reset(parser);
+    }
+}
+
+uint16_t fpm_parser_feed(FPM_Parser * parser, const uint8_t * bytes, uint16_t len) {
+    uint16_t packets = 0;
+    uint8_t failed;
+    
+    while (len > 0) {
+        uint16_t used = parse_span(parser, bytes, len, &packets, &failed);
+        bytes += used;
+        len -= used;
+        
+        if (failed) {
+            PARSER_COUNT(parser, resyncs);
+            FPM_TRACE(parser->trace, FPM_TRACE_RESYNC, 0, parser->lookback_len, 0);
+            resync(parser, &packets);
+        }
+    }
+    
+    return packets;
+}
+
+typedef struct {
+    uint8_t pid;
+    uint16_t len;
+} FPM_Reply;
+
+static void on_reply(void * ctx, uint8_t pid, uint8_t * data, uint16_t len) {
+    (void)data;
+    
+    FPM_Reply * reply = (FPM_Reply *)ctx;
+    reply->pid = pid;
+    reply->len = len;
+}
+
+/* reads up to 'avail' bytes for 'parser', never past the end of the current packet: 
+ * whatever follows belongs to the next caller.
+ * Payload goes straight into the parser's buffer, only the framing is staged in 'fpm->frame',
+ * which is free since nothing else is being transmitted while we wait for a reply */
+static uint16_t read_for_parser(FPM * fpm, FPM_Parser * parser, uint16_t avail, uint16_t * packets) {
+    uint8_t * dest = fpm->frame;
+    uint16_t to_read = fpm_parser_wanted(parser);
+    
+    if (parser->state == FPM_STATE_READ_CONTENTS && parser->buf != NULL) {
+        dest = &parser->buf[parser->pos];
+        to_read = (parser->length - 2) - parser->pos;
+    }
+    
+    if (avail < to_read)
+        to_read = avail;
+    
+    uint16_t got = fpm->read_func(dest, to_read);
+    fpm->stats.rx_bytes += got;
+    
+    if (got > 0)
+        FPM_TRACE(&fpm->trace, FPM_TRACE_RX, 0, got, 0);
+    
+    *packets = fpm_parser_feed(parser, dest, got);
+    
+    return got;
+}
+
+static int16_t get_reply(FPM * fpm, uint8_t * replyBuf, uint16_t buflen, uint8_t * pktid, uint16_t timeout) {
+    FPM_Parser parser;
+    FPM_Reply reply = {0};
+    
+    fpm_parser_init(&parser, fpm->address, replyBuf, buflen, on_reply, &reply);
+    parser.stats = &fpm->stats;
+#if defined(FPM_ENABLE_TRACE)
+    parser.trace = &fpm->trace;
+#endif
+    
+    uint32_t last_read = fpm->millis_func();
+    uint32_t elapsed;
+    
+    while ((elapsed = fpm->millis_func() - last_read) < timeout) {
+        /* the command may still be going out by DMA from 'fpm->frame' */
+        if (fpm->tx_busy) {
+            if (fpm->sleep_func != NULL)
+                fpm->sleep_func(0);
+            continue;
+        }
+        
+        /* no point waking up for less than the parser can use */
+        uint16_t avail;
+        if (fpm->wait_func != NULL)
+            avail = fpm->wait_func(fpm_parser_wanted(&parser), timeout - elapsed);
+        else
+            avail = fpm->avail_func();
+        
+        if (avail == 0)
+            continue;
+        
+        last_read = fpm->millis_func();
+        
+        uint16_t packets;
+        read_for_parser(fpm, &parser, avail, &packets);
+        
+        if (packets) {
+            *pktid = reply.pid;
+            return reply.len;
+        }
+    }
+    
     FPM_ERROR_PRINTLN("[+]Response timeout\r\n");
+    fpm->stats.timeouts++;
+    FPM_TRACE(&fpm->trace, FPM_TRACE_TIMEOUT, fpm->cmd_opcode, timeout, 0);
+    
+    /* if the command never finished going out, don't let the next one wait on it forever */
+    fpm->tx_busy = 0;
     return FPM_TIMEOUT;
 }
 
@@ -723,19 +2039,28 @@ static int16_t get_reply(FPM * fpm, uint8_t * replyBuf, uint16_t buflen,
  * return packet length and confirmation code */
 static int16_t read_ack_get_response(FPM * fpm, uint8_t * rc) {
     uint8_t pktid = 0;
-    int16_t len = get_reply(fpm, fpm->buffer, FPM_BUFFER_SZ, &pktid, NULL);
+    uint8_t opcode = fpm->cmd_opcode;
+    int16_t len = get_reply(fpm, fpm->buffer, FPM_BUFFER_SZ, &pktid, command_timeout(fpm, opcode));
     
     /* most likely timed out */
-    if (len < 0)
+    if (len < 0) {
+        if (len == FPM_TIMEOUT)
+            record_timeout(fpm, opcode);
         return len;
+    }
+    
+    record_latency(fpm, opcode, fpm->millis_func() - fpm->cmd_sent);
     
     /* wrong pkt id */
     if (pktid != FPM_ACKPACKET) {
         FPM_ERROR_PRINTLN("[+]Wrong PID: 0x%X", pktid);
+        fpm->stats.pid_errors++;
+        FPM_TRACE(&fpm->trace, FPM_TRACE_BAD_PID, pktid, 0, 0);
         return FPM_READ_ERROR;
     }
     
     *rc = fpm->buffer[0];
+    FPM_TRACE(&fpm->trace, FPM_TRACE_DONE, opcode, *rc, fpm->millis_func() - fpm->cmd_sent);
     
     /* minus confirmation code */
     return --len;
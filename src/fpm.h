@@ -32,6 +32,38 @@ extern "C" {
  */
 #define FPM_DEBUG_LEVEL             1
 
+/***************** Latency histograms ******************/
+
+/* keeps a histogram of reply latencies for each command in the FPM struct (about 1.7 KB),
+   see fpm_get_histogram(). Uncomment this line (or define it when compiling) to enable them */
+//#define FPM_ENABLE_HISTOGRAMS
+
+/***************** Tracing *****************************/
+
+/* records protocol events (packets, errors, command results) into a small ring in the FPM struct,
+   at a few cycles each, without the timing upsets of printf debugging. See fpm_trace_read().
+   Uncomment this line (or define it when compiling) to enable it */
+//#define FPM_ENABLE_TRACE
+
+/* orders the trace ring's writes for a reader in another context or on another core.
+   The default is for GCC and Clang; define it when compiling with anything else */
+#ifndef FPM_MEMORY_BARRIER
+    #define FPM_MEMORY_BARRIER()    __sync_synchronize()
+#endif
+
+/***************** Template index cache ****************/
+
+/* keeps the sensor's template occupancy bitmap in the FPM struct (32 bytes per page of 256 templates),
+   read a page at a time as needed and kept up to date by the library's store, delete and empty commands.
+   Free IDs, used IDs and the template count then come without round-trips.
+   Uncomment this line (or define it when compiling) to enable it */
+//#define FPM_ENABLE_INDEX_CACHE
+
+/* pages cached, at most 16; IDs past them are looked up on the sensor every time */
+#ifndef FPM_INDEX_CACHE_PAGES
+    #define FPM_INDEX_CACHE_PAGES   4
+#endif
+
 // confirmation codes
 #define FPM_OK                      0x00
 #define FPM_HANDSHAKE_OK            0x55
@@ -104,17 +136,75 @@ extern "C" {
 #define FPM_READ_ERROR              -2
 /* returned whenever there's no free ID */
 #define FPM_NOFREEINDEX             -1
+/* returned by the async API when another command is still in flight */
+#define FPM_BUSY                    -3
 
 #define FPM_MAX_PACKET_LEN          256
 #define FPM_PKT_OVERHEAD_LEN        12
 
+/* start code, address, PID and length */
+#define FPM_PKT_HEADER_LEN          9
+
+/* staging area big enough for a whole frame of the largest packet length */
+#define FPM_FRAME_SZ                (FPM_MAX_PACKET_LEN + FPM_PKT_OVERHEAD_LEN)
+
+/* bytes kept after a start code, rescanned for the next start code when a packet turns out bad */
+#define FPM_RESYNC_WINDOW           32
+
 /* 32 is max packet length for ACKed commands, +1 for confirmation code */
 #define FPM_BUFFER_SZ               (32 + 1)
 
-/* default timeout is 2 seconds */
+/* default timeout is 2 seconds, used until a command's latency has been observed */
 #define FPM_DEFAULT_TIMEOUT         2000
+
+/* adaptive timeouts: MULTIPLIER x the recent peak latency of each command, plus MARGIN ms,
+   and never less than MIN_TIMEOUT ms */
+#define FPM_TIMEOUT_MULTIPLIER      2
+#define FPM_TIMEOUT_MARGIN          200
+#define FPM_MIN_TIMEOUT             250
+
+/* floor for the commands whose latency depends on the outcome, so a run of fast replies doesn't
+   time out the next slow one: capturing with or without a finger, a search hitting early or missing */
+#define FPM_MIN_OUTCOME_TIMEOUT     1000
+
+/* pseudo-opcode for the timeout on data packets, for use with fpm_set_timeout() */
+#define FPM_TIMEOUT_DATA            0xFF
+
+/* number of commands (plus data packets) that keep their own timeout */
+#define FPM_TIMED_COMMANDS          26
+
+/* latency histogram buckets: 0 and 1 ms, then two per power of 2 up to 65535 ms */
+#define FPM_HISTOGRAM_BUCKETS       32
+
+/* bucket count, counts and timeouts, as written by fpm_histogram_serialize() */
+#define FPM_HISTOGRAM_SERIALIZED_SZ (1 + 2 * FPM_HISTOGRAM_BUCKETS + 2)
+
+/* trace events kept, a power of 2. The oldest ones are overwritten */
+#define FPM_TRACE_LEN               64
+
+/* size of a trace event from fpm_trace_pack() */
+#define FPM_TRACE_PACKED_SZ         12
+
+/* trace events, with what goes into 'arg8', 'arg16' and 'arg32' */
+#define FPM_TRACE_COMMAND           0x01    /* command sent: opcode, length */
+#define FPM_TRACE_DATA_TX           0x02    /* other packet sent: PID, length */
+#define FPM_TRACE_RX                0x03    /* bytes read from the UART: -, count */
+#define FPM_TRACE_START_CODE        0x04    /* start code found */
+#define FPM_TRACE_PACKET            0x05    /* packet received and verified: PID, length */
+#define FPM_TRACE_BAD_ADDRESS       0x06    /* -, -, address */
+#define FPM_TRACE_BAD_LENGTH        0x07    /* -, length field */
+#define FPM_TRACE_BAD_CHECKSUM      0x08    /* -, checksum received, checksum computed */
+#define FPM_TRACE_RESYNC            0x09    /* -, bytes rescanned */
+#define FPM_TRACE_TIMEOUT           0x0A    /* last opcode sent, timeout in ms */
+#define FPM_TRACE_BAD_PID           0x0B    /* PID */
+#define FPM_TRACE_DONE              0x0C    /* opcode, confirmation code (or error), latency in ms */
+#define FPM_TRACE_SET_PARAM         0x0D    /* parameter, value */
+
 #define FPM_TEMPLATES_PER_PAGE      256
 
+/* bytes of occupancy bits in a page of the template index */
+#define FPM_INDEX_PAGE_SZ           (FPM_TEMPLATES_PER_PAGE / 8)
+
 #define FPM_DEFAULT_PASSWORD        0x00000000
 #define FPM_DEFAULT_ADDRESS         0xFFFFFFFF
 
@@ -162,10 +252,21 @@ enum {
     FPM_PLEN_NONE = 0xff
 };
 
+/* states of the packet parser */
+typedef enum {
+    FPM_STATE_READ_HEADER,
+    FPM_STATE_READ_ADDRESS,
+    FPM_STATE_READ_PID,
+    FPM_STATE_READ_LENGTH,
+    FPM_STATE_READ_CONTENTS,
+    FPM_STATE_READ_CHECKSUM
+} FPM_State;
+
 /* possible output containers for template/image data read from the module */
 enum {
     FPM_OUTPUT_TO_STREAM,
-    FPM_OUTPUT_TO_BUFFER
+    FPM_OUTPUT_TO_BUFFER,
+    FPM_OUTPUT_TO_SINK
 };
  
 typedef struct {
@@ -182,6 +283,177 @@ typedef uint16_t (*fpm_uart_read_func)(uint8_t * bytes, uint16_t len);
 typedef void (*fpm_uart_write_func)(uint8_t * bytes, uint16_t len);
 typedef uint16_t (*fpm_uart_avail_func)(void);
 typedef uint32_t (*fpm_millis_func)(void);
+typedef void (*fpm_set_baud_func)(uint32_t baud);
+
+/* blocks until at least 'min_bytes' are waiting or 'timeout' ms have passed
+   (returning earlier is fine), and returns how many are waiting */
+typedef uint16_t (*fpm_wait_func)(uint16_t min_bytes, uint16_t timeout);
+
+/* gives up the CPU for up to 'ms' ms, or if 0 just until something may have changed, e.g. the next interrupt */
+typedef void (*fpm_sleep_func)(uint16_t ms);
+
+/* gets the payload of each data packet once its checksum has passed;
+   'is_last' is set for the final packet of the transfer */
+typedef void (*fpm_sink_func)(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last);
+
+typedef struct {
+    fpm_sink_func func;
+    void * ctx;
+} FPM_Sink;
+
+/* fills 'buf' with up to 'len' bytes of the template and returns how many, 0 if there's no more */
+typedef uint16_t (*fpm_source_func)(void * ctx, uint8_t * buf, uint16_t len);
+
+typedef struct {
+    fpm_source_func func;
+    void * ctx;
+} FPM_Source;
+
+/* summary of a template or image transfer */
+typedef struct {
+    uint16_t bytes;
+    uint16_t packets;
+    /* CRC-32 (as in zlib) of all the data */
+    uint32_t crc;
+    /* ms from the first command to the last packet (fetch) or the template being stored (push) */
+    uint32_t elapsed;
+} FPM_Transfer;
+
+/* called for every complete packet that passes the checksum;
+   'data' is the parser's buffer, or NULL if the payload was streamed */
+typedef void (*fpm_packet_func)(void * ctx, uint8_t pid, uint8_t * data, uint16_t len);
+
+/* transport health, counted since the FPM struct was zeroed or the last reset */
+typedef struct {
+    uint32_t tx_bytes;
+    uint32_t tx_packets;
+    uint32_t rx_bytes;
+    /* packets that passed all checks */
+    uint32_t rx_packets;
+    
+    uint32_t checksum_errors;
+    uint32_t address_errors;
+    /* length fields too small, or too big for the packet length or the reply buffer */
+    uint32_t length_errors;
+    /* times the parser rescanned a bad packet for another start code */
+    uint32_t resyncs;
+    uint32_t timeouts;
+    /* well-formed packets of a type that wasn't expected there */
+    uint32_t pid_errors;
+    /* bytes flushed before the command following a timeout, e.g. the reply that came too late */
+    uint32_t stale_bytes;
+} FPM_Stats;
+
+typedef struct {
+    /* from 'clock_func', or millis by default */
+    uint32_t time;
+    uint8_t event;
+    uint8_t arg8;
+    uint16_t arg16;
+    uint32_t arg32;
+} FPM_Trace_Event;
+
+/* single producer (the library), single consumer (fpm_trace_read()), no locks.
+   Each slot has a sequence number: the number of the event it holds plus one, or the number
+   of the one being written into it, so the reader can tell an event that changed under it.
+   Zeroed with the FPM struct, or with fpm_trace_reset() */
+typedef struct {
+    FPM_Trace_Event events[FPM_TRACE_LEN];
+    volatile uint32_t seq[FPM_TRACE_LEN];
+    volatile uint32_t head;
+    uint32_t tail;
+    
+    /* optional: a finer clock for the timestamps, e.g. a cycle or us counter.
+       fpm_begin() sets it to the handle's millis if it's NULL */
+    fpm_millis_func clock_func;
+} FPM_Trace;
+
+/* Resumable packet parser. Bytes can be fed in spans of any size,
+   from a UART ISR, a DMA callback or a read() loop,
+   and complete packets are handed to 'packet_func' */
+typedef struct {
+    uint32_t address;
+    
+    /* payload is stored here, packets longer than 'buflen' are dropped.
+       If NULL, the payload is passed on to 'stream' as it arrives instead */
+    uint8_t * buf;
+    uint16_t buflen;
+    fpm_uart_write_func stream;
+    
+    fpm_packet_func packet_func;
+    void * ctx;
+    
+    /* optional: errors and packets are counted here. NULL after fpm_parser_init() */
+    FPM_Stats * stats;
+    
+#if defined(FPM_ENABLE_TRACE)
+    /* optional: events go here. NULL after fpm_parser_init() */
+    FPM_Trace * trace;
+#endif
+    
+    /* internal state */
+    FPM_State state;
+    uint16_t header;
+    uint8_t field[4];
+    uint8_t field_pos;
+    uint8_t pid;
+    uint16_t length;
+    uint16_t chksum;
+    uint16_t pos;
+    
+    /* the last bytes seen since the start code, for resyncing */
+    uint8_t lookback[FPM_RESYNC_WINDOW];
+    uint8_t lookback_len;
+} FPM_Parser;
+
+typedef struct {
+    /* running average of the observed latency in ms, 0 until the first reply */
+    uint16_t average;
+    /* the slowest latency seen lately: it jumps up to each slower reply and sinks back slowly */
+    uint16_t peak;
+    /* set with fpm_set_timeout(), 0 to adapt */
+    uint16_t fixed;
+} FPM_Timing;
+
+/* counts saturate at 0xFFFF */
+typedef struct {
+    uint16_t counts[FPM_HISTOGRAM_BUCKETS];
+    uint16_t timeouts;
+} FPM_Histogram;
+
+/* the template index as FPM_READTEMPLATEINDEX returns it, one bit per ID (LSb first) */
+typedef struct {
+    uint8_t bits[FPM_INDEX_CACHE_PAGES * FPM_INDEX_PAGE_SZ];
+    /* one bit per page */
+    uint16_t loaded;
+} FPM_Index_Cache;
+
+/* called when an asynchronous command completes;
+   'rc' is what the blocking version of the command would have returned */
+typedef void (*fpm_done_func)(void * ctx, int16_t rc);
+
+/* state of the command in flight, if any */
+typedef struct {
+    uint8_t active;
+    uint8_t opcode;
+    
+    fpm_done_func done_func;
+    void * ctx;
+    
+    /* where the results go, for commands that return any */
+    uint16_t * out1;
+    uint16_t * out2;
+    
+    /* templates stored or deleted, for the index cache */
+    uint16_t id;
+    uint16_t how_many;
+    
+    uint32_t last_read;
+    uint8_t got_reply;
+    uint8_t pid;
+    uint16_t len;
+    FPM_Parser parser;
+} FPM_Command;
 
 typedef struct {
     fpm_uart_read_func read_func;
@@ -194,6 +466,30 @@ typedef struct {
     /* only set this flag if you have an R308 or want to set parameters manually */
     uint8_t manual_settings;
     
+    /* set this flag if 'write_func' only starts the transfer (e.g. by DMA)
+       and returns before it's done. The driver must then call fpm_tx_done()
+       once the bytes are out and the buffer it was given can be reused */
+    uint8_t async_tx;
+    
+    /* how many received bytes the transport can hold before it starts dropping them, 0 if unknown.
+       If set, fpm_begin() lowers the sensor's packet length until a whole frame fits */
+    uint16_t rx_capacity;
+    
+    /* optional: switches the host UART to 'baud' bits/s.
+       If set, fpm_set_param() retunes the host along with the sensor when changing the baud rate */
+    fpm_set_baud_func set_baud_func;
+    
+    /* optional: without these the library spins on 'avail_func' and the clock while it waits
+       for the sensor, e.g. for the seconds a search can take. With them it blocks in 'wait_func'
+       (a semaphore given by the UART ISR, __WFI, poll()...) and sleeps in 'sleep_func' instead */
+    fpm_wait_func wait_func;
+    fpm_sleep_func sleep_func;
+    
+    /* set this flag to have fpm_begin() step the link up to the largest packet length
+       and (with 'set_baud_func') the fastest baud rate that pass a round-trip check,
+       falling back to the last good setting on failure */
+    uint8_t auto_link;
+    
     /* no need to initialize this member unless you have an R308 sensor,
        or want to set parameters manually.
        In that case, make sure to use the defaults below,
@@ -201,6 +497,39 @@ typedef struct {
     FPM_System_Params sys_params;
     
     uint8_t buffer[FPM_BUFFER_SZ];
+    
+    /* outgoing packets are assembled here and handed to 'write_func' in one go */
+    uint8_t frame[FPM_FRAME_SZ];
+    volatile uint8_t tx_busy;
+    
+    /* set by fpm_begin(); every handle has its own clock, so sensors can be driven from different threads */
+    fpm_millis_func millis_func;
+    
+    /* last command sent, and when */
+    uint8_t cmd_opcode;
+    uint32_t cmd_sent;
+    
+    /* set when a reply times out: it may still come in, so the input is flushed before the next command */
+    uint8_t stale_input;
+    
+    FPM_Timing timing[FPM_TIMED_COMMANDS];
+    
+    FPM_Stats stats;
+    
+#if defined(FPM_ENABLE_HISTOGRAMS)
+    FPM_Histogram histograms[FPM_TIMED_COMMANDS];
+#endif
+
+#if defined(FPM_ENABLE_TRACE)
+    FPM_Trace trace;
+#endif
+
+#if defined(FPM_ENABLE_INDEX_CACHE)
+    FPM_Index_Cache index_cache;
+#endif
+    
+    /* used by the async API */
+    FPM_Command pending;
 } FPM;
 
 /* Default parameters to be used with R308 sensor (and similar)
@@ -216,6 +545,9 @@ typedef struct {
 */
 
 
+/* The library keeps no global state: the clock, the transport functions and everything else
+   live in the FPM handle, so each sensor can be driven from its own thread (as long as
+   a handle is only used by one thread at a time). See examples/linux/stress.c */
 uint8_t fpm_begin(FPM * fpm, fpm_millis_func _millis_func);
 
 int16_t fpm_get_image(FPM * fpm);
@@ -231,16 +563,48 @@ int16_t fpm_load_model(FPM * fpm, uint16_t id, uint8_t slot);
 int16_t fpm_set_param(FPM * fpm, uint8_t param, uint8_t value);
 int16_t fpm_read_params(FPM * fpm, FPM_System_Params * user_params);
 int16_t fpm_down_image(FPM * fpm);
+/* reads one data packet into 'out', which is:
+   FPM_OUTPUT_TO_BUFFER: a buffer of '*read_len' bytes, '*read_len' is set to the payload length
+   FPM_OUTPUT_TO_STREAM: an fpm_uart_write_func, called once with the whole payload
+   FPM_OUTPUT_TO_SINK: an FPM_Sink
+   Stream and sink only ever see payloads that passed the checksum */
 uint8_t fpm_read_raw(FPM * fpm, uint8_t outType, void * out, uint8_t * read_complete, uint16_t * read_len);
 void fpm_write_raw(FPM * fpm, uint8_t * data, uint16_t len);
 
+/* loads template #'id' into buffer #1 and streams it to 'sink', packet by packet.
+   'summary' may be NULL. Returns FPM_OK, a confirmation code or FPM_READ_ERROR/FPM_TIMEOUT */
+int16_t fpm_fetch_template(FPM * fpm, uint16_t id, FPM_Sink * sink, FPM_Transfer * summary);
+
+/* uploads the image in the image buffer (from fpm_get_image()) to 'sink', packet by packet.
+   Pixels are packed two per byte, see fpm_image.h to unpack them */
+int16_t fpm_fetch_image(FPM * fpm, FPM_Sink * sink, FPM_Transfer * summary);
+
+/* streams a template of 'len' bytes from 'source' into buffer #1, one packet at a time, and stores it as #'id'.
+   The source writes straight into the outgoing frame, so no copy of the whole template is needed.
+   Returns FPM_OK, a confirmation code, FPM_READ_ERROR if 'len' is 0 or the source ran dry early, or FPM_TIMEOUT */
+int16_t fpm_push_template(FPM * fpm, uint16_t id, FPM_Source * source, uint16_t len, FPM_Transfer * summary);
+
+/* CRC-32 (as in zlib), start with crc = 0 */
+uint32_t fpm_crc32(uint32_t crc, const uint8_t * data, uint16_t len);
+
 /* initiates the transfer of the template in buffer #'slot' to the MCU */
 int16_t fpm_download_model(FPM * fpm, uint8_t slot);
 int16_t fpm_upload_model(FPM * fpm, uint8_t slot);
 int16_t fpm_delete_model(FPM * fpm, uint16_t id, uint16_t how_many);
 int16_t fpm_search_database(FPM * fpm, uint16_t * finger_id, uint16_t * score, uint8_t slot);
 int16_t fpm_get_template_count(FPM * fpm, uint16_t * template_cnt);
+
+/* the first free ID in 'page', or FPM_NOFREEINDEX in '*id' if it's full */
 int16_t fpm_get_free_index(FPM * fpm, uint8_t page, int16_t * id);
+
+/* the first ID from 'from' on that holds a template, or -1 in '*id' if there are none.
+   Call it again with the ID after that to walk the database */
+int16_t fpm_get_used_index(FPM * fpm, uint16_t from, int16_t * id);
+
+/* With FPM_ENABLE_INDEX_CACHE the three calls above answer from the cache once the pages they need have been read.
+   Call this if the database was changed other than through this handle, e.g. by another host */
+void fpm_invalidate_index(FPM * fpm);
+
 int16_t fpm_match_template_pair(FPM * fpm, uint16_t * score);
 int16_t fpm_set_password(FPM * fpm, uint32_t pwd);
 int16_t fpm_get_random_number(FPM * fpm, uint32_t * number);
@@ -257,6 +621,103 @@ int16_t fpm_standby(FPM * fpm);
    Should return true if the sensor is ready to accept commands */
 uint8_t fpm_handshake(FPM * fpm);
 
+/* Asynchronous variants: these send the command and return at once with FPM_OK,
+   or FPM_BUSY if another command is in flight. Call fpm_poll() from your main loop
+   until 'done_func' is called with the result.
+   Don't mix them with the blocking functions while a command is in flight. */
+int16_t fpm_get_image_async(FPM * fpm, fpm_done_func done_func, void * ctx);
+int16_t fpm_get_imageNL_async(FPM * fpm, fpm_done_func done_func, void * ctx);
+int16_t fpm_image2Tz_async(FPM * fpm, uint8_t slot, fpm_done_func done_func, void * ctx);
+int16_t fpm_create_model_async(FPM * fpm, fpm_done_func done_func, void * ctx);
+int16_t fpm_store_model_async(FPM * fpm, uint16_t id, uint8_t slot, fpm_done_func done_func, void * ctx);
+int16_t fpm_load_model_async(FPM * fpm, uint16_t id, uint8_t slot, fpm_done_func done_func, void * ctx);
+int16_t fpm_download_model_async(FPM * fpm, uint8_t slot, fpm_done_func done_func, void * ctx);
+int16_t fpm_upload_model_async(FPM * fpm, uint8_t slot, fpm_done_func done_func, void * ctx);
+int16_t fpm_delete_model_async(FPM * fpm, uint16_t id, uint16_t how_many, fpm_done_func done_func, void * ctx);
+int16_t fpm_empty_database_async(FPM * fpm, fpm_done_func done_func, void * ctx);
+
+/* 'finger_id' and 'score' must stay valid until 'done_func' is called, same for the others below */
+int16_t fpm_search_database_async(FPM * fpm, uint16_t * finger_id, uint16_t * score, uint8_t slot,
+                                  fpm_done_func done_func, void * ctx);
+int16_t fpm_match_template_pair_async(FPM * fpm, uint16_t * score, fpm_done_func done_func, void * ctx);
+int16_t fpm_get_template_count_async(FPM * fpm, uint16_t * template_cnt, fpm_done_func done_func, void * ctx);
+int16_t fpm_led_on_async(FPM * fpm, fpm_done_func done_func, void * ctx);
+int16_t fpm_led_off_async(FPM * fpm, fpm_done_func done_func, void * ctx);
+
+/* reads whatever reply bytes have arrived and completes the pending command if possible.
+   Returns 1 while a command is still in flight */
+uint8_t fpm_poll(FPM * fpm);
+uint8_t fpm_busy(FPM * fpm);
+
+/* for 'async_tx' transports: call this (from an ISR is fine) when the last buffer passed to 'write_func' has been sent.
+   If it isn't called within the command's timeout, the command fails with FPM_TIMEOUT */
+void fpm_tx_done(FPM * fpm);
+
+void fpm_parser_init(FPM_Parser * parser, uint32_t address, uint8_t * buf, uint16_t buflen,
+                     fpm_packet_func packet_func, void * ctx);
+void fpm_parser_reset(FPM_Parser * parser);
+
+/* consumes all 'len' bytes and returns the number of packets completed.
+   'bytes' may point into 'buf' at the current payload position, for reading payloads in place.
+   After a bad address, length or checksum, parsing resumes from the next start code 
+   within the last FPM_RESYNC_WINDOW bytes, rather than after the bad packet */
+uint16_t fpm_parser_feed(FPM_Parser * parser, const uint8_t * bytes, uint16_t len);
+
+/* how many bytes the parser can take without going past the end of the current packet */
+uint16_t fpm_parser_wanted(FPM_Parser * parser);
+
+/* bytes on the wire for a data packet of the given FPM_PLEN_* length,
+   size your UART RX buffer to hold at least one of these */
+uint16_t fpm_frame_size(uint8_t packet_len);
+
+/* Timeouts are kept per command, adapted to the latency seen so far.
+   fpm_set_timeout() fixes the timeout for 'opcode' (or FPM_TIMEOUT_DATA) in ms, 0 goes back to adapting */
+void fpm_set_timeout(FPM * fpm, uint8_t opcode, uint16_t timeout);
+uint16_t fpm_get_timeout(FPM * fpm, uint8_t opcode);
+
+/* copies the transport counters into 'stats', and clears them if 'reset' is set */
+void fpm_get_stats(FPM * fpm, FPM_Stats * stats, uint8_t reset);
+
+/* Latency histograms, with FPM_ENABLE_HISTOGRAMS: the time from sending each command
+   to its reply, in ms, plus the number of timeouts. Searches aren't scaled by the database size.
+   fpm_get_histogram() copies the one for 'opcode' (or FPM_TIMEOUT_DATA) into 'snapshot' and clears it
+   if 'reset' is set. Returns 0 if that command isn't tracked */
+#if defined(FPM_ENABLE_HISTOGRAMS)
+uint8_t fpm_get_histogram(FPM * fpm, uint8_t opcode, FPM_Histogram * snapshot, uint8_t reset);
+void fpm_reset_histograms(FPM * fpm);
+#endif
+
+/* these work on snapshots, with or without FPM_ENABLE_HISTOGRAMS, e.g. to combine those of several sensors */
+void fpm_histogram_merge(FPM_Histogram * into, const FPM_Histogram * from);
+
+/* the upper limit in ms of the bucket holding the 'percent'th percentile, 0 if there are no samples */
+uint16_t fpm_histogram_percentile(const FPM_Histogram * hist, uint8_t percent);
+
+/* the range of latencies in 'bucket', in ms */
+uint16_t fpm_histogram_bucket_min(uint8_t bucket);
+uint16_t fpm_histogram_bucket_max(uint8_t bucket);
+
+/* to FPM_HISTOGRAM_SERIALIZED_SZ bytes, big-endian. Deserializing returns 0, or -1 if the layout differs */
+void fpm_histogram_serialize(const FPM_Histogram * hist, uint8_t * buf);
+int8_t fpm_histogram_deserialize(FPM_Histogram * hist, const uint8_t * buf);
+
+/* Tracing, with FPM_ENABLE_TRACE: fpm_trace_read() moves up to 'max' events, oldest first, into 'events'
+   and returns how many. '*dropped' (if not NULL) is set to the number of events overwritten since the last call.
+   Safe to call from one other context than the one running the library, e.g. a debug task or another core;
+   an event overwritten while it's being copied is counted as dropped rather than returned torn */
+#if defined(FPM_ENABLE_TRACE)
+uint16_t fpm_trace_read(FPM * fpm, FPM_Trace_Event * events, uint16_t max, uint32_t * dropped);
+void fpm_trace_reset(FPM * fpm);
+#endif
+
+/* to and from FPM_TRACE_PACKED_SZ big-endian bytes, for dumping events to a host.
+   fpm_trace.c has the host-side decoder */
+void fpm_trace_pack(const FPM_Trace_Event * event, uint8_t * buf);
+void fpm_trace_unpack(FPM_Trace_Event * event, const uint8_t * buf);
+
+/* bits/s for one of the FPM_BAUD_* values */
+uint32_t fpm_baud_rate(uint8_t baud);
+
 extern const uint16_t fpm_packet_lengths[];
 
 #ifdef __cplusplus
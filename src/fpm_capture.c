@@ -0,0 +1,275 @@
+#include "fpm_capture.h"
+#include <string.h>
+
+typedef struct {
+    uint8_t type;
+    uint32_t delta;
+    uint32_t value;
+    const uint8_t * data;
+} capture_record;
+
+static uint8_t put_varint(uint8_t * buf, uint32_t value) {
+    uint8_t len = 0;
+
+    while (value >= 0x80) {
+        buf[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+
+    buf[len++] = value;
+    return len;
+}
+
+/* returns 0 if the varint runs past the end */
+static uint32_t get_varint(const uint8_t * data, uint32_t len, uint32_t pos, uint32_t * value) {
+    uint32_t result = 0;
+
+    for (uint8_t shift = 0; pos < len && shift < 35; shift += 7) {
+        uint8_t byte = data[pos++];
+        result |= (uint32_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80)) {
+            *value = result;
+            return pos;
+        }
+    }
+
+    return 0;
+}
+
+/* parses the record at 'pos', returns the position of the next one, or 0 at the end or if it's truncated */
+static uint32_t parse_record(const uint8_t * data, uint32_t len, uint32_t pos, capture_record * rec) {
+    if (pos >= len)
+        return 0;
+
+    rec->type = data[pos++];
+
+    pos = get_varint(data, len, pos, &rec->delta);
+    if (pos == 0)
+        return 0;
+
+    pos = get_varint(data, len, pos, &rec->value);
+    if (pos == 0)
+        return 0;
+
+    rec->data = &data[pos];
+
+    if (rec->type == FPM_CAPTURE_BAUD)
+        return pos;
+
+    if (rec->value > 0xFFFF || rec->value > len - pos)
+        return 0;
+
+    return pos + rec->value;
+}
+
+/*** Recording ***/
+
+static void emit(FPM_Recorder * rec, uint8_t type, uint32_t value, const uint8_t * data, uint16_t len) {
+    uint8_t hdr[FPM_CAPTURE_RECORD_HDR_MAX];
+    uint32_t now = rec->micros_func();
+    uint8_t hdr_len = 0;
+
+    hdr[hdr_len++] = type;
+    hdr_len += put_varint(&hdr[hdr_len], now - rec->last);
+    hdr_len += put_varint(&hdr[hdr_len], value);
+    rec->last = now;
+
+    rec->out->func(rec->out->ctx, hdr, hdr_len, 0);
+    if (len > 0)
+        rec->out->func(rec->out->ctx, data, len, 0);
+
+    rec->records++;
+    rec->bytes += hdr_len + len;
+}
+
+void fpm_recorder_init(FPM_Recorder * rec, FPM_Sink * out, fpm_micros_func micros_func) {
+    rec->out = out;
+    rec->micros_func = micros_func;
+    rec->last = micros_func();
+    rec->records = 0;
+    rec->bytes = FPM_CAPTURE_MAGIC_LEN;
+
+    out->func(out->ctx, (const uint8_t *)FPM_CAPTURE_MAGIC, FPM_CAPTURE_MAGIC_LEN, 0);
+}
+
+void fpm_recorder_finish(FPM_Recorder * rec) {
+    rec->out->func(rec->out->ctx, NULL, 0, 1);
+}
+
+uint16_t fpm_recorder_read(FPM_Recorder * rec, uint8_t * bytes, uint16_t len) {
+    uint16_t n = rec->read_func(bytes, len);
+
+    if (n > 0)
+        emit(rec, FPM_CAPTURE_READ, n, bytes, n);
+
+    return n;
+}
+
+void fpm_recorder_write(FPM_Recorder * rec, uint8_t * bytes, uint16_t len) {
+    /* before handing them on, 'write_func' may start a transfer that outlives the call */
+    emit(rec, FPM_CAPTURE_WRITE, len, bytes, len);
+    rec->write_func(bytes, len);
+}
+
+/* polling isn't recorded, the timestamps of the reads say when data was there */
+uint16_t fpm_recorder_avail(FPM_Recorder * rec) {
+    return rec->avail_func();
+}
+
+void fpm_recorder_set_baud(FPM_Recorder * rec, uint32_t baud) {
+    emit(rec, FPM_CAPTURE_BAUD, baud, NULL, 0);
+    rec->set_baud_func(baud);
+}
+
+/*** Replay ***/
+
+int fpm_replay_init(FPM_Replay * replay, const uint8_t * data, uint32_t len,
+                    fpm_micros_func micros_func, uint16_t speedup) {
+    capture_record rec;
+
+    if (len < FPM_CAPTURE_MAGIC_LEN || memcmp(data, FPM_CAPTURE_MAGIC, FPM_CAPTURE_MAGIC_LEN) != 0)
+        return -1;
+
+    memset(replay, 0, sizeof(FPM_Replay));
+    replay->data = data;
+    replay->len = len;
+    replay->micros_func = micros_func;
+    replay->speedup = speedup;
+
+    replay->rpos = FPM_CAPTURE_MAGIC_LEN;
+    replay->wpos = FPM_CAPTURE_MAGIC_LEN;
+    replay->anchor_at = micros_func();
+
+    for (uint32_t pos = FPM_CAPTURE_MAGIC_LEN; (pos = parse_record(data, len, pos, &rec)) != 0; ) {
+        if (rec.type == FPM_CAPTURE_BAUD)
+            replay->has_baud = 1;
+    }
+
+    return 0;
+}
+
+/* finds the next bytes for the host, if the writes they answer have been made */
+static uint8_t load_read(FPM_Replay * replay) {
+    capture_record rec;
+
+    if (replay->rvalid)
+        return 1;
+
+    while (1) {
+        uint32_t next = parse_record(replay->data, replay->len, replay->rpos, &rec);
+        if (next == 0)
+            return 0;
+
+        /* still waiting for the host to send this */
+        if (rec.type == FPM_CAPTURE_WRITE && replay->rpos >= replay->wpos)
+            return 0;
+
+        uint32_t pos = replay->rpos;
+        replay->rpos = next;
+        replay->rtime += rec.delta;
+
+        if (rec.type != FPM_CAPTURE_READ || rec.value == 0)
+            continue;
+
+        replay->rdata = rec.data;
+        replay->rleft = rec.value;
+        replay->rvalid = 1;
+
+        /* the host is behind, as it would find these bytes already waiting */
+        if (pos < replay->anchor_pos || replay->speedup == 0) {
+            replay->rdue = replay->anchor_at;
+        }
+        else {
+            uint64_t delay = (replay->rtime - replay->anchor_time) / replay->speedup;
+            replay->rdue = replay->anchor_at + (uint32_t)delay;
+        }
+
+        return 1;
+    }
+}
+
+uint16_t fpm_replay_avail(FPM_Replay * replay) {
+    if (!load_read(replay))
+        return 0;
+
+    if ((int32_t)(replay->micros_func() - replay->rdue) < 0)
+        return 0;
+
+    return replay->rleft;
+}
+
+uint16_t fpm_replay_read(FPM_Replay * replay, uint8_t * bytes, uint16_t len) {
+    uint16_t avail = fpm_replay_avail(replay);
+
+    if (len > avail)
+        len = avail;
+
+    memcpy(bytes, replay->rdata, len);
+    replay->rdata += len;
+    replay->rleft -= len;
+
+    if (replay->rleft == 0)
+        replay->rvalid = 0;
+
+    return len;
+}
+
+void fpm_replay_write(FPM_Replay * replay, uint8_t * bytes, uint16_t len) {
+    capture_record rec;
+    uint8_t matched = 1;
+
+    while (len > 0) {
+        uint32_t next = parse_record(replay->data, replay->len, replay->wpos, &rec);
+
+        /* more than the recorded host ever sent */
+        if (next == 0) {
+            replay->mismatches++;
+            return;
+        }
+
+        if (rec.type != FPM_CAPTURE_WRITE) {
+            replay->wpos = next;
+            replay->wtime += rec.delta;
+            continue;
+        }
+
+        uint16_t n = rec.value - replay->wdone;
+        if (n > len)
+            n = len;
+
+        if (memcmp(bytes, rec.data + replay->wdone, n) != 0)
+            matched = 0;
+
+        bytes += n;
+        len -= n;
+        replay->wdone += n;
+
+        if (replay->wdone == rec.value) {
+            replay->anchor_pos = replay->wpos;
+            replay->anchor_time = replay->wtime + rec.delta;
+            replay->anchor_at = replay->micros_func();
+
+            replay->wpos = next;
+            replay->wtime = replay->anchor_time;
+            replay->wdone = 0;
+        }
+    }
+
+    if (!matched)
+        replay->mismatches++;
+}
+
+uint8_t fpm_replay_done(FPM_Replay * replay) {
+    capture_record rec;
+
+    if (load_read(replay))
+        return 0;
+
+    for (uint32_t pos = replay->wpos; (pos = parse_record(replay->data, replay->len, pos, &rec)) != 0; ) {
+        if (rec.type == FPM_CAPTURE_WRITE)
+            return 0;
+    }
+
+    return 1;
+}
@@ -0,0 +1,148 @@
+/***************************************************
+  UART traffic capture and replay for the FPM library
+  Distributed under the terms of the MIT license
+ ****************************************************/
+#ifndef FPM_CAPTURE_H_
+#define FPM_CAPTURE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "fpm.h"
+
+/* A capture is the FPM_CAPTURE_MAGIC header followed by one record per transport call:
+ *
+ *     type (1 byte)  delta (varint)  value (varint)  [data]
+ *
+ * 'delta' is the time in us since the previous record, all varints are LEB128.
+ * For READ and WRITE records 'value' is the length of the data that follows;
+ * for BAUD records it is the new baud rate and no data follows. */
+#define FPM_CAPTURE_MAGIC           "FPMC\x01"
+#define FPM_CAPTURE_MAGIC_LEN       5
+
+#define FPM_CAPTURE_READ            0x01    /* bytes the sensor sent, as returned by 'read_func' */
+#define FPM_CAPTURE_WRITE           0x02    /* bytes passed to 'write_func' */
+#define FPM_CAPTURE_BAUD            0x03    /* a call to 'set_baud_func' */
+
+/* a type byte, two 5-byte varints */
+#define FPM_CAPTURE_RECORD_HDR_MAX  11
+
+typedef uint32_t (*fpm_micros_func)(void);
+
+/* Recording: wraps the transport functions of an FPM handle and
+   passes everything that goes through them on to 'out', as a capture */
+typedef struct {
+    fpm_uart_read_func read_func;
+    fpm_uart_write_func write_func;
+    fpm_uart_avail_func avail_func;
+    fpm_set_baud_func set_baud_func;
+
+    FPM_Sink * out;
+    fpm_micros_func micros_func;
+    uint32_t last;
+
+    uint32_t records;
+    uint32_t bytes;
+} FPM_Recorder;
+
+/* starts a capture on 'out', writing the header. Attach it with FPM_RECORDER_ATTACH afterwards */
+void fpm_recorder_init(FPM_Recorder * rec, FPM_Sink * out, fpm_micros_func micros_func);
+
+/* ends the capture, calling 'out' with 'is_last' set */
+void fpm_recorder_finish(FPM_Recorder * rec);
+
+uint16_t fpm_recorder_read(FPM_Recorder * rec, uint8_t * bytes, uint16_t len);
+void fpm_recorder_write(FPM_Recorder * rec, uint8_t * bytes, uint16_t len);
+uint16_t fpm_recorder_avail(FPM_Recorder * rec);
+void fpm_recorder_set_baud(FPM_Recorder * rec, uint32_t baud);
+
+/* Replay: stands in for the sensor, feeding a capture back to the library.
+ *
+ * What the sensor sent after each write is released relative to the time the host
+ * makes that write, with the recorded delays divided by 'speedup' (1 for the original
+ * timing, 0 for none at all), so a capture can be replayed against a changed protocol layer.
+ * Writes are compared with the recorded ones; differences are counted in 'mismatches'
+ * and the replay carries on regardless. */
+typedef struct {
+    const uint8_t * data;
+    uint32_t len;
+    fpm_micros_func micros_func;
+    uint16_t speedup;
+
+    /* next record to read from, its recorded time and the data left in it */
+    uint32_t rpos;
+    uint64_t rtime;
+    const uint8_t * rdata;
+    uint16_t rleft;
+    uint32_t rdue;
+    uint8_t rvalid;
+
+    /* next write record, its recorded time and how much of it was matched so far */
+    uint32_t wpos;
+    uint64_t wtime;
+    uint16_t wdone;
+
+    /* the last write the host completed: where it is, its recorded time and when it happened */
+    uint32_t anchor_pos;
+    uint64_t anchor_time;
+    uint32_t anchor_at;
+
+    /* whether the recorded host changed baud rates, so the replaying one gets to do the same */
+    uint8_t has_baud;
+
+    uint32_t mismatches;
+} FPM_Replay;
+
+/* 'data' must stay valid during the replay. Returns 0, or -1 if it isn't a capture */
+int fpm_replay_init(FPM_Replay * replay, const uint8_t * data, uint32_t len,
+                    fpm_micros_func micros_func, uint16_t speedup);
+
+/* 1 once everything in the capture has been read and written */
+uint8_t fpm_replay_done(FPM_Replay * replay);
+
+uint16_t fpm_replay_read(FPM_Replay * replay, uint8_t * bytes, uint16_t len);
+void fpm_replay_write(FPM_Replay * replay, uint8_t * bytes, uint16_t len);
+uint16_t fpm_replay_avail(FPM_Replay * replay);
+
+/* The library calls its transport functions without a context, so these generate
+   a recorder or replay named 'name' and the functions for it. Use them once per sensor, at file scope.
+   FPM_RECORDER_ATTACH wraps whatever transport is attached to 'fpm' at that point, its 'wait_func' is left as is */
+#define FPM_RECORDER_PORT(name) \
+    static FPM_Recorder name; \
+    static uint16_t name##_read(uint8_t * bytes, uint16_t len) { return fpm_recorder_read(&name, bytes, len); } \
+    static void name##_write(uint8_t * bytes, uint16_t len) { fpm_recorder_write(&name, bytes, len); } \
+    static uint16_t name##_avail(void) { return fpm_recorder_avail(&name); } \
+    static void name##_set_baud(uint32_t baud) { fpm_recorder_set_baud(&name, baud); }
+
+#define FPM_RECORDER_ATTACH(fpm, name) do { \
+        name.read_func = (fpm)->read_func; \
+        name.write_func = (fpm)->write_func; \
+        name.avail_func = (fpm)->avail_func; \
+        name.set_baud_func = (fpm)->set_baud_func; \
+        (fpm)->read_func = name##_read; \
+        (fpm)->write_func = name##_write; \
+        (fpm)->avail_func = name##_avail; \
+        (fpm)->set_baud_func = (name.set_baud_func != NULL) ? name##_set_baud : NULL; \
+    } while (0)
+
+#define FPM_REPLAY_PORT(name) \
+    static FPM_Replay name; \
+    static uint16_t name##_read(uint8_t * bytes, uint16_t len) { return fpm_replay_read(&name, bytes, len); } \
+    static void name##_write(uint8_t * bytes, uint16_t len) { fpm_replay_write(&name, bytes, len); } \
+    static uint16_t name##_avail(void) { return fpm_replay_avail(&name); } \
+    static void name##_set_baud(uint32_t baud) { (void)baud; }
+
+#define FPM_REPLAY_ATTACH(fpm, name) do { \
+        (fpm)->read_func = name##_read; \
+        (fpm)->write_func = name##_write; \
+        (fpm)->avail_func = name##_avail; \
+        (fpm)->set_baud_func = name.has_baud ? name##_set_baud : NULL; \
+        (fpm)->wait_func = NULL; \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
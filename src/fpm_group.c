@@ -0,0 +1,191 @@
+#include "fpm_group.h"
+#include <string.h>
+
+void fpm_group_init(FPM_Group * group) {
+    memset(group, 0, sizeof(FPM_Group));
+}
+
+int8_t fpm_group_add(FPM_Group * group, FPM * fpm) {
+    uint16_t capacity = fpm->sys_params.capacity;
+
+    if (group->count == FPM_GROUP_MAX_SENSORS || capacity > 0xFFFF - group->capacity)
+        return -1;
+
+    FPM_Group_Member * member = &group->members[group->count];
+    member->fpm = fpm;
+    member->first_id = group->capacity;
+
+    group->capacity += capacity;
+    return group->count++;
+}
+
+/* index of the sensor holding 'global_id', -1 if none does */
+static int8_t find_member(FPM_Group * group, uint16_t global_id) {
+    for (uint8_t i = 0; i < group->count; i++) {
+        FPM_Group_Member * member = &group->members[i];
+
+        if ((uint16_t)(global_id - member->first_id) < member->fpm->sys_params.capacity)
+            return i;
+    }
+
+    return -1;
+}
+
+FPM * fpm_group_locate(FPM_Group * group, uint16_t global_id, uint16_t * local_id) {
+    int8_t i = find_member(group, global_id);
+
+    if (i < 0)
+        return NULL;
+
+    *local_id = global_id - group->members[i].first_id;
+    return group->members[i].fpm;
+}
+
+/* reads the template in buffer 'slot' of 'fpm' into 'group->template_buf' */
+static int16_t fetch_slot(FPM_Group * group, FPM * fpm, uint8_t slot) {
+    uint8_t read_complete = 0;
+
+    group->template_len = 0;
+
+    int16_t rc = fpm_download_model(fpm, slot);
+    if (rc != FPM_OK)
+        return rc;
+
+    while (!read_complete) {
+        uint16_t len = FPM_GROUP_TEMPLATE_SZ - group->template_len;
+
+        if (!fpm_read_raw(fpm, FPM_OUTPUT_TO_BUFFER, &group->template_buf[group->template_len], &read_complete, &len))
+            return FPM_READ_ERROR;
+
+        group->template_len += len;
+    }
+
+    return FPM_OK;
+}
+
+/* sends 'group->template_buf' to buffer 'slot' of 'fpm', in its own packet length */
+static int16_t push_slot(FPM_Group * group, FPM * fpm, uint8_t slot) {
+    int16_t rc = fpm_upload_model(fpm, slot);
+    if (rc != FPM_OK)
+        return rc;
+
+    fpm_write_raw(fpm, group->template_buf, group->template_len);
+    return FPM_OK;
+}
+
+int16_t fpm_group_distribute(FPM_Group * group, uint8_t from, uint8_t slot) {
+    if (from >= group->count)
+        return FPM_BADLOCATION;
+
+    if (group->count == 1)
+        return FPM_OK;
+
+    int16_t rc = fetch_slot(group, group->members[from].fpm, slot);
+    if (rc != FPM_OK)
+        return rc;
+
+    for (uint8_t i = 0; i < group->count; i++) {
+        if (i == from)
+            continue;
+
+        rc = push_slot(group, group->members[i].fpm, slot);
+        if (rc != FPM_OK)
+            return rc;
+    }
+
+    return FPM_OK;
+}
+
+static void on_search_done(void * ctx, int16_t rc) {
+    ((FPM_Group_Member *)ctx)->rc = rc;
+}
+
+int16_t fpm_group_search(FPM_Group * group, uint8_t reader, uint8_t slot, uint16_t * global_id, uint16_t * score) {
+    if (reader >= group->count)
+        return FPM_BADLOCATION;
+
+    FPM * clock = group->members[reader].fpm;
+    uint32_t start = clock->millis_func();
+
+    int16_t rc = fpm_group_distribute(group, reader, slot);
+    if (rc != FPM_OK)
+        return rc;
+
+    uint32_t searching = clock->millis_func();
+    group->distribute_ms = searching - start;
+
+    for (uint8_t i = 0; i < group->count; i++) {
+        FPM_Group_Member * member = &group->members[i];
+
+        member->rc = FPM_BUSY;
+        rc = fpm_search_database_async(member->fpm, &member->id, &member->score, slot, on_search_done, member);
+        if (rc != FPM_OK)
+            member->rc = rc;
+    }
+
+    /* the sensors search at the same time, each on its own UART */
+    uint8_t busy;
+    do {
+        busy = 0;
+        for (uint8_t i = 0; i < group->count; i++)
+            busy |= fpm_poll(group->members[i].fpm);
+
+        if (busy && clock->sleep_func != NULL)
+            clock->sleep_func(0);
+    } while (busy);
+
+    group->search_ms = clock->millis_func() - searching;
+
+    int8_t best = -1;
+    rc = FPM_NOTFOUND;
+
+    for (uint8_t i = 0; i < group->count; i++) {
+        FPM_Group_Member * member = &group->members[i];
+
+        if (member->rc == FPM_OK) {
+            if (best < 0 || member->score > group->members[best].score)
+                best = i;
+        }
+        else if (member->rc != FPM_NOTFOUND && rc == FPM_NOTFOUND) {
+            rc = member->rc;
+        }
+    }
+
+    if (best < 0)
+        return rc;
+
+    *global_id = group->members[best].first_id + group->members[best].id;
+    *score = group->members[best].score;
+    return FPM_OK;
+}
+
+int16_t fpm_group_store_model(FPM_Group * group, uint8_t reader, uint8_t slot, uint16_t global_id) {
+    int8_t owner = find_member(group, global_id);
+
+    if (owner < 0 || reader >= group->count)
+        return FPM_BADLOCATION;
+
+    FPM * fpm = group->members[owner].fpm;
+
+    if (owner != reader) {
+        int16_t rc = fetch_slot(group, group->members[reader].fpm, slot);
+        if (rc != FPM_OK)
+            return rc;
+
+        rc = push_slot(group, fpm, slot);
+        if (rc != FPM_OK)
+            return rc;
+    }
+
+    return fpm_store_model(fpm, global_id - group->members[owner].first_id, slot);
+}
+
+int16_t fpm_group_delete_model(FPM_Group * group, uint16_t global_id) {
+    uint16_t local_id;
+    FPM * fpm = fpm_group_locate(group, global_id, &local_id);
+
+    if (fpm == NULL)
+        return FPM_BADLOCATION;
+
+    return fpm_delete_model(fpm, local_id, 1);
+}
@@ -0,0 +1,77 @@
+/***************************************************
+  Sensor groups for the FPM library: several modules as one database
+  Distributed under the terms of the MIT license
+ ****************************************************/
+#ifndef FPM_GROUP_H_
+#define FPM_GROUP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "fpm.h"
+
+#define FPM_GROUP_MAX_SENSORS       8
+
+/* the largest template to copy between sensors; define it when compiling if yours are bigger */
+#ifndef FPM_GROUP_TEMPLATE_SZ
+    #define FPM_GROUP_TEMPLATE_SZ   1536
+#endif
+
+typedef struct {
+    FPM * fpm;
+
+    /* global ID of the sensor's template #0, the sensors' ID ranges follow each other */
+    uint16_t first_id;
+
+    /* result of the last fpm_group_search() on this sensor */
+    int16_t rc;
+    uint16_t id;
+    uint16_t score;
+} FPM_Group_Member;
+
+/* Template IDs are sharded across the sensors in the order they were added:
+ * with capacities of 200 and 300, global IDs 0-199 live on the first one and 200-499 on the second */
+typedef struct {
+    FPM_Group_Member members[FPM_GROUP_MAX_SENSORS];
+    uint8_t count;
+    uint16_t capacity;
+
+    /* a template on its way from one sensor to the others */
+    uint8_t template_buf[FPM_GROUP_TEMPLATE_SZ];
+    uint16_t template_len;
+
+    /* ms the last fpm_group_search() took copying the template around, and searching */
+    uint32_t distribute_ms;
+    uint32_t search_ms;
+} FPM_Group;
+
+void fpm_group_init(FPM_Group * group);
+
+/* adds a sensor that fpm_begin() has been called on, using its 'sys_params.capacity'.
+   Returns its index in the group, or -1 if the group is full or the IDs would run out */
+int8_t fpm_group_add(FPM_Group * group, FPM * fpm);
+
+/* the sensor that holds 'global_id' and the ID it has there, or NULL if it's out of range */
+FPM * fpm_group_locate(FPM_Group * group, uint16_t global_id, uint16_t * local_id);
+
+/* copies the template in buffer 'slot' of sensor 'from' to the same buffer of every other sensor.
+   Returns FPM_OK, or the first error */
+int16_t fpm_group_distribute(FPM_Group * group, uint8_t from, uint8_t slot);
+
+/* 1:N search of the whole group for the template in buffer 'slot' of sensor 'reader' (e.g. from fpm_image2Tz()).
+   The template is distributed first, then all sensors search at once through the async API.
+   Returns FPM_OK with the best-scoring match as a global ID, FPM_NOTFOUND if no sensor had one,
+   or the first error if some sensor failed and none matched */
+int16_t fpm_group_search(FPM_Group * group, uint8_t reader, uint8_t slot, uint16_t * global_id, uint16_t * score);
+
+/* stores the template in buffer 'slot' of sensor 'reader' as 'global_id', copying it to the sensor that holds it first */
+int16_t fpm_group_store_model(FPM_Group * group, uint8_t reader, uint8_t slot, uint16_t global_id);
+
+int16_t fpm_group_delete_model(FPM_Group * group, uint16_t global_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
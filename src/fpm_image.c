@@ -0,0 +1,128 @@
+#include "fpm_image.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+void fpm_unpack_pixels_ref(const uint8_t * packed, uint8_t * pixels, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t hi = packed[i] >> 4;
+        uint8_t lo = packed[i] & 0x0F;
+
+        /* x17 maps 0..15 onto 0..255 */
+        pixels[2 * i] = hi * 17;
+        pixels[2 * i + 1] = lo * 17;
+    }
+}
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON) && \
+    defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+
+/* 2 packed bytes (in bits 0..7 and 16..23) into 4 pixels in a word */
+static inline uint32_t spread_nibbles(uint32_t v) {
+    uint32_t w = ((v & 0x00F000F0) >> 4) | ((v & 0x000F000F) << 8);
+
+    /* no pixel exceeds 15, so this can't carry into the next one */
+    return w * 17;
+}
+
+#endif
+
+void fpm_unpack_pixels(const uint8_t * packed, uint8_t * pixels, uint32_t len) {
+    uint32_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&packed[i]);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        __m128i lo = _mm_and_si128(v, mask);
+
+        /* left pixel first */
+        __m128i p0 = _mm_unpacklo_epi8(hi, lo);
+        __m128i p1 = _mm_unpackhi_epi8(hi, lo);
+
+        /* x17, as (x << 4) | x: each byte holds at most 15, so nothing crosses into its neighbour */
+        p0 = _mm_or_si128(_mm_slli_epi16(p0, 4), p0);
+        p1 = _mm_or_si128(_mm_slli_epi16(p1, 4), p1);
+
+        _mm_storeu_si128((__m128i *)&pixels[2 * i], p0);
+        _mm_storeu_si128((__m128i *)&pixels[2 * i + 16], p1);
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(&packed[i]);
+        uint8x16x2_t p;
+
+        p.val[0] = vshrq_n_u8(v, 4);
+        p.val[1] = vandq_u8(v, mask);
+
+        p.val[0] = vorrq_u8(vshlq_n_u8(p.val[0], 4), p.val[0]);
+        p.val[1] = vorrq_u8(vshlq_n_u8(p.val[1], 4), p.val[1]);
+
+        /* interleaving store puts the left pixel first */
+        vst2q_u8(&pixels[2 * i], p);
+    }
+#elif defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    /* 4 bytes in, 8 pixels out per round; memcpy compiles to plain (unaligned) loads and stores on Cortex-M3/M4 */
+    for (; i + 4 <= len; i += 4) {
+        uint32_t v, out[2];
+
+        memcpy(&v, &packed[i], 4);
+        out[0] = spread_nibbles((v & 0xFF) | ((v & 0xFF00) << 8));
+        out[1] = spread_nibbles(((v >> 16) & 0xFF) | ((v >> 8) & 0xFF0000));
+        memcpy(&pixels[2 * i], out, 8);
+    }
+#endif
+
+    /* whatever is left over */
+    fpm_unpack_pixels_ref(&packed[i], &pixels[2 * i], len - i);
+}
+
+static void unpack_sink(void * ctx, const uint8_t * data, uint16_t len, uint8_t is_last) {
+    FPM_Unpacker * unpacker = (FPM_Unpacker *)ctx;
+
+    fpm_unpack_pixels(data, unpacker->pixels, len);
+    unpacker->out->func(unpacker->out->ctx, unpacker->pixels, 2 * len, is_last);
+}
+
+void fpm_unpacker_init(FPM_Unpacker * unpacker, FPM_Sink * out, FPM_Sink * sink) {
+    unpacker->out = out;
+    sink->func = unpack_sink;
+    sink->ctx = unpacker;
+}
+
+/* appends 'value' in decimal, returns the number of digits */
+static uint16_t put_decimal(char * buf, uint16_t value) {
+    char digits[5];
+    uint16_t n = 0;
+
+    do {
+        digits[n++] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (uint16_t i = 0; i < n; i++)
+        buf[i] = digits[n - 1 - i];
+
+    return n;
+}
+
+uint16_t fpm_pgm_header(char * buf, uint16_t width, uint16_t height) {
+    uint16_t pos = 0;
+
+    buf[pos++] = 'P'; buf[pos++] = '5'; buf[pos++] = '\n';
+    pos += put_decimal(&buf[pos], width);
+    buf[pos++] = ' ';
+    pos += put_decimal(&buf[pos], height);
+    buf[pos++] = '\n';
+    buf[pos++] = '2'; buf[pos++] = '5'; buf[pos++] = '5'; buf[pos++] = '\n';
+
+    return pos;
+}
@@ -0,0 +1,49 @@
+/***************************************************
+  Fingerprint image decoding for the FPM library
+  Distributed under the terms of the MIT license
+ ****************************************************/
+#ifndef FPM_IMAGE_H_
+#define FPM_IMAGE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "fpm.h"
+
+/* image size of the R30x sensors, adjust for yours */
+#define FPM_IMAGE_WIDTH             256
+#define FPM_IMAGE_HEIGHT            288
+
+/* pixels are sent as 4-bit values, two per byte, left pixel in the high nibble */
+#define FPM_IMAGE_PACKED_SZ         (FPM_IMAGE_WIDTH * FPM_IMAGE_HEIGHT / 2)
+#define FPM_IMAGE_SZ                (FPM_IMAGE_WIDTH * FPM_IMAGE_HEIGHT)
+
+/* "P5 256 288 255" plus some room */
+#define FPM_PGM_HEADER_MAX          24
+
+/* unpacks 'len' bytes of 4-bit pixels into 2 * 'len' 8-bit pixels, scaled to 0..255.
+   Uses SSE2 or NEON when available, word-wise operations otherwise */
+void fpm_unpack_pixels(const uint8_t * packed, uint8_t * pixels, uint32_t len);
+
+/* plain byte-at-a-time version, for reference and benchmarks */
+void fpm_unpack_pixels_ref(const uint8_t * packed, uint8_t * pixels, uint32_t len);
+
+/* sink adapter: unpacks each packet from fpm_fetch_image() and passes the 8-bit pixels on to 'out' */
+typedef struct {
+    FPM_Sink * out;
+    uint8_t pixels[2 * FPM_MAX_PACKET_LEN];
+} FPM_Unpacker;
+
+/* sets up 'sink' to feed 'unpacker' */
+void fpm_unpacker_init(FPM_Unpacker * unpacker, FPM_Sink * out, FPM_Sink * sink);
+
+/* writes a binary PGM (P5) header for an 8-bit image into 'buf', returns its length.
+   The raw pixels follow, row by row */
+uint16_t fpm_pgm_header(char * buf, uint16_t width, uint16_t height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,225 @@
+/* for O_CLOEXEC and clock_gettime() under strict C modes with glibc */
+#ifndef _DEFAULT_SOURCE
+    #define _DEFAULT_SOURCE
+#endif
+
+#include "fpm_posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#if defined(__linux__)
+    /* termios2 takes any baud rate, but can't be mixed with <termios.h> */
+    #include <asm/termbits.h>
+    #include <linux/serial.h>
+#else
+    #include <termios.h>
+#endif
+
+#if defined(__linux__)
+
+static int configure(int fd, uint32_t baud, uint8_t raw) {
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) < 0)
+        return -1;
+
+    if (raw) {
+        /* what cfmakeraw() does, 8N1, no flow control */
+        tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY);
+        tio.c_oflag &= ~OPOST;
+        tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+        tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+        tio.c_cflag |= CS8 | CREAD | CLOCAL;
+
+        /* read() returns at once with whatever is there */
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+    }
+
+    tio.c_cflag &= ~CBAUD;
+    tio.c_cflag |= BOTHER;
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+
+    return ioctl(fd, TCSETS2, &tio);
+}
+
+/* have the driver pass on bytes as they come, rather than batching them (e.g. the FTDI latency timer) */
+static void set_low_latency(int fd) {
+    struct serial_struct serial;
+
+    /* not all drivers support it, which is fine */
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+}
+
+static void flush_input(int fd) {
+    ioctl(fd, TCFLSH, TCIFLUSH);
+}
+
+#else
+
+static int configure(int fd, uint32_t baud, uint8_t raw) {
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) < 0)
+        return -1;
+
+    if (raw) {
+        cfmakeraw(&tio);
+        tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+        tio.c_cflag |= CREAD | CLOCAL;
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+    }
+
+    /* the BSDs and macOS take plain numbers as speeds */
+    if (cfsetspeed(&tio, (speed_t)baud) < 0)
+        return -1;
+
+    return tcsetattr(fd, TCSANOW, &tio);
+}
+
+static void set_low_latency(int fd) {
+    (void)fd;
+}
+
+static void flush_input(int fd) {
+    tcflush(fd, TCIFLUSH);
+}
+
+#endif
+
+int fpm_posix_open(FPM_Posix * port, const char * path, uint32_t baud) {
+    port->fd = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    port->wait_ms = FPM_POSIX_WAIT_MS;
+
+    if (port->fd < 0)
+        return -1;
+
+    if (configure(port->fd, baud, 1) < 0) {
+        int err = errno;
+        close(port->fd);
+        port->fd = -1;
+        errno = err;
+        return -1;
+    }
+
+    set_low_latency(port->fd);
+
+    /* drop whatever came in before we were listening */
+    flush_input(port->fd);
+    return 0;
+}
+
+void fpm_posix_close(FPM_Posix * port) {
+    if (port->fd >= 0)
+        close(port->fd);
+
+    port->fd = -1;
+}
+
+int fpm_posix_set_baud(FPM_Posix * port, uint32_t baud) {
+    return configure(port->fd, baud, 0);
+}
+
+uint16_t fpm_posix_read(FPM_Posix * port, uint8_t * bytes, uint16_t len) {
+    ssize_t n;
+
+    do {
+        n = read(port->fd, bytes, len);
+    } while (n < 0 && errno == EINTR);
+
+    return (n > 0) ? (uint16_t)n : 0;
+}
+
+void fpm_posix_write(FPM_Posix * port, uint8_t * bytes, uint16_t len) {
+    while (len > 0) {
+        ssize_t n = write(port->fd, bytes, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* the port is gone, the reply will time out */
+            return;
+        }
+
+        bytes += n;
+        len -= n;
+    }
+}
+
+static uint16_t bytes_waiting(int fd) {
+    int avail = 0;
+
+    if (ioctl(fd, FIONREAD, &avail) < 0 || avail < 0)
+        return 0;
+
+    return (avail > 0xFFFF) ? 0xFFFF : (uint16_t)avail;
+}
+
+uint16_t fpm_posix_avail(FPM_Posix * port) {
+    uint16_t avail = bytes_waiting(port->fd);
+
+    if (avail != 0 || port->wait_ms <= 0)
+        return avail;
+
+    struct pollfd pfd = { port->fd, POLLIN, 0 };
+
+    if (poll(&pfd, 1, port->wait_ms) <= 0)
+        return 0;
+
+    return bytes_waiting(port->fd);
+}
+
+uint16_t fpm_posix_wait(FPM_Posix * port, uint16_t min_bytes, uint16_t timeout) {
+    uint32_t start = fpm_posix_millis();
+    uint16_t avail = bytes_waiting(port->fd);
+    
+    /* poll() can't be told how many bytes to wait for, so this returns once there are any
+       and the library takes them as they come */
+    while (avail == 0 && min_bytes > 0) {
+        uint32_t elapsed = fpm_posix_millis() - start;
+        if (elapsed >= timeout)
+            break;
+        
+        struct pollfd pfd = { port->fd, POLLIN, 0 };
+        
+        if (poll(&pfd, 1, (int)(timeout - elapsed)) < 0 && errno != EINTR)
+            break;
+        
+        avail = bytes_waiting(port->fd);
+    }
+    
+    return avail;
+}
+
+void fpm_posix_sleep(uint16_t ms) {
+    struct timespec ts;
+    
+    /* 0 is a request to yield, which a short nap does as well */
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L + ((ms == 0) ? 100000L : 0);
+    
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+uint32_t fpm_posix_millis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint32_t fpm_posix_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
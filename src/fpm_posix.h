@@ -0,0 +1,76 @@
+/***************************************************
+  POSIX serial transport for the FPM library
+  Distributed under the terms of the MIT license
+ ****************************************************/
+#ifndef FPM_POSIX_H_
+#define FPM_POSIX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "fpm.h"
+
+/* how long fpm_posix_avail() blocks in poll() when no bytes are waiting, by default */
+#define FPM_POSIX_WAIT_MS           10
+
+typedef struct {
+    int fd;
+
+    /* ms for fpm_posix_avail() to wait for data when there's none,
+       0 to return at once (e.g. when using fpm_poll() from an event loop) */
+    int wait_ms;
+} FPM_Posix;
+
+/* opens a serial port (e.g. "/dev/ttyUSB0") in raw 8N1 mode, with low-latency flags where supported.
+   Any baud rate the sensor uses is accepted. Returns 0, or -1 with errno set */
+int fpm_posix_open(FPM_Posix * port, const char * path, uint32_t baud);
+void fpm_posix_close(FPM_Posix * port);
+int fpm_posix_set_baud(FPM_Posix * port, uint32_t baud);
+
+uint16_t fpm_posix_read(FPM_Posix * port, uint8_t * bytes, uint16_t len);
+void fpm_posix_write(FPM_Posix * port, uint8_t * bytes, uint16_t len);
+
+/* bytes waiting to be read; if none, waits up to 'wait_ms' for some to arrive
+   so that the library's receive loops sleep instead of spinning */
+uint16_t fpm_posix_avail(FPM_Posix * port);
+
+/* for the FPM's 'wait_func': blocks in poll() until 'min_bytes' are waiting or 'timeout' ms have passed */
+uint16_t fpm_posix_wait(FPM_Posix * port, uint16_t min_bytes, uint16_t timeout);
+
+/* for the FPM's 'sleep_func' */
+void fpm_posix_sleep(uint16_t ms);
+
+/* CLOCK_MONOTONIC, for fpm_begin() */
+uint32_t fpm_posix_millis(void);
+
+/* the same in us, e.g. for capture timestamps */
+uint32_t fpm_posix_micros(void);
+
+/* The library calls its transport functions without a context, so this generates
+   a port named 'name' and the functions for it, to be hooked up with FPM_POSIX_ATTACH.
+   Use it once per sensor, at file scope. FPM_POSIX_ATTACH goes after fpm_posix_open():
+   with the library blocking in 'wait_func', 'avail' no longer needs to wait */
+#define FPM_POSIX_PORT(name) \
+    static FPM_Posix name; \
+    static uint16_t name##_read(uint8_t * bytes, uint16_t len) { return fpm_posix_read(&name, bytes, len); } \
+    static void name##_write(uint8_t * bytes, uint16_t len) { fpm_posix_write(&name, bytes, len); } \
+    static uint16_t name##_avail(void) { return fpm_posix_avail(&name); } \
+    static void name##_set_baud(uint32_t baud) { fpm_posix_set_baud(&name, baud); } \
+    static uint16_t name##_wait(uint16_t min_bytes, uint16_t timeout) { return fpm_posix_wait(&name, min_bytes, timeout); }
+
+#define FPM_POSIX_ATTACH(fpm, name) do { \
+        (fpm)->read_func = name##_read; \
+        (fpm)->write_func = name##_write; \
+        (fpm)->avail_func = name##_avail; \
+        (fpm)->set_baud_func = name##_set_baud; \
+        (fpm)->wait_func = name##_wait; \
+        (fpm)->sleep_func = fpm_posix_sleep; \
+        name.wait_ms = 0; \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
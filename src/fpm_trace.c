@@ -0,0 +1,90 @@
+#include "fpm_trace.h"
+#include <stdio.h>
+
+const char * fpm_trace_event_name(uint8_t event) {
+    switch (event) {
+        case FPM_TRACE_COMMAND:         return "COMMAND";
+        case FPM_TRACE_DATA_TX:         return "DATA_TX";
+        case FPM_TRACE_RX:              return "RX";
+        case FPM_TRACE_START_CODE:      return "START_CODE";
+        case FPM_TRACE_PACKET:          return "PACKET";
+        case FPM_TRACE_BAD_ADDRESS:     return "BAD_ADDRESS";
+        case FPM_TRACE_BAD_LENGTH:      return "BAD_LENGTH";
+        case FPM_TRACE_BAD_CHECKSUM:    return "BAD_CHECKSUM";
+        case FPM_TRACE_RESYNC:          return "RESYNC";
+        case FPM_TRACE_TIMEOUT:         return "TIMEOUT";
+        case FPM_TRACE_BAD_PID:         return "BAD_PID";
+        case FPM_TRACE_DONE:            return "DONE";
+        case FPM_TRACE_SET_PARAM:       return "SET_PARAM";
+        default:                        return "?";
+    }
+}
+
+const char * fpm_opcode_name(uint8_t opcode) {
+    switch (opcode) {
+        case FPM_GETIMAGE:              return "GETIMAGE";
+        case FPM_IMAGE2TZ:              return "IMAGE2TZ";
+        case FPM_PAIRMATCH:             return "PAIRMATCH";
+        case FPM_SEARCH:                return "SEARCH";
+        case FPM_REGMODEL:              return "REGMODEL";
+        case FPM_STORE:                 return "STORE";
+        case FPM_LOAD:                  return "LOAD";
+        case FPM_UPCHAR:                return "UPCHAR";
+        case FPM_DOWNCHAR:              return "DOWNCHAR";
+        case FPM_IMGUPLOAD:             return "IMGUPLOAD";
+        case FPM_DELETE:                return "DELETE";
+        case FPM_EMPTYDATABASE:         return "EMPTYDATABASE";
+        case FPM_SETSYSPARAM:           return "SETSYSPARAM";
+        case FPM_READSYSPARAM:          return "READSYSPARAM";
+        case FPM_SETPASSWORD:           return "SETPASSWORD";
+        case FPM_VERIFYPASSWORD:        return "VERIFYPASSWORD";
+        case FPM_GETRANDOM:             return "GETRANDOM";
+        case FPM_HISPEEDSEARCH:         return "HISPEEDSEARCH";
+        case FPM_TEMPLATECOUNT:         return "TEMPLATECOUNT";
+        case FPM_READTEMPLATEINDEX:     return "READTEMPLATEINDEX";
+        case FPM_STANDBY:               return "STANDBY";
+        case FPM_HANDSHAKE:             return "HANDSHAKE";
+        case FPM_LEDON:                 return "LEDON";
+        case FPM_LEDOFF:                return "LEDOFF";
+        case FPM_GETIMAGE_NOLIGHT:      return "GETIMAGE_NOLIGHT";
+        case FPM_TIMEOUT_DATA:          return "DATA";
+        default:                        return "?";
+    }
+}
+
+int fpm_trace_format(const FPM_Trace_Event * event, char * buf, size_t len) {
+    unsigned long time = event->time;
+    const char * name = fpm_trace_event_name(event->event);
+
+    switch (event->event) {
+        case FPM_TRACE_COMMAND:
+            return snprintf(buf, len, "%10lu %-12s %s, %u bytes", time, name,
+                            fpm_opcode_name(event->arg8), event->arg16);
+        case FPM_TRACE_DATA_TX:
+        case FPM_TRACE_PACKET:
+            return snprintf(buf, len, "%10lu %-12s PID 0x%02X, %u bytes", time, name, event->arg8, event->arg16);
+        case FPM_TRACE_RX:
+            return snprintf(buf, len, "%10lu %-12s %u bytes", time, name, event->arg16);
+        case FPM_TRACE_BAD_ADDRESS:
+            return snprintf(buf, len, "%10lu %-12s 0x%08lX", time, name, (unsigned long)event->arg32);
+        case FPM_TRACE_BAD_LENGTH:
+            return snprintf(buf, len, "%10lu %-12s %u", time, name, event->arg16);
+        case FPM_TRACE_BAD_CHECKSUM:
+            return snprintf(buf, len, "%10lu %-12s got 0x%04X, expected 0x%04lX", time, name,
+                            event->arg16, (unsigned long)event->arg32);
+        case FPM_TRACE_RESYNC:
+            return snprintf(buf, len, "%10lu %-12s %u bytes rescanned", time, name, event->arg16);
+        case FPM_TRACE_TIMEOUT:
+            return snprintf(buf, len, "%10lu %-12s %s after %u ms", time, name,
+                            fpm_opcode_name(event->arg8), event->arg16);
+        case FPM_TRACE_BAD_PID:
+            return snprintf(buf, len, "%10lu %-12s 0x%02X", time, name, event->arg8);
+        case FPM_TRACE_DONE:
+            return snprintf(buf, len, "%10lu %-12s %s, code %d, %lu ms", time, name,
+                            fpm_opcode_name(event->arg8), (int16_t)event->arg16, (unsigned long)event->arg32);
+        case FPM_TRACE_SET_PARAM:
+            return snprintf(buf, len, "%10lu %-12s param %u = %u", time, name, event->arg8, event->arg16);
+        default:
+            return snprintf(buf, len, "%10lu %s", time, name);
+    }
+}
@@ -0,0 +1,28 @@
+/***************************************************
+  Host-side decoding of FPM trace events
+  Distributed under the terms of the MIT license
+ ****************************************************/
+#ifndef FPM_TRACE_H_
+#define FPM_TRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "fpm.h"
+
+/* "COMMAND", "PACKET" and so on, or "?" */
+const char * fpm_trace_event_name(uint8_t event);
+
+/* "SEARCH", "IMAGE2TZ" and so on, or "?" */
+const char * fpm_opcode_name(uint8_t opcode);
+
+/* one line of text for 'event' (without a newline), with timestamps in the units it was recorded in.
+   Returns what snprintf() does */
+int fpm_trace_format(const FPM_Trace_Event * event, char * buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif